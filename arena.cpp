@@ -0,0 +1,161 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <new>
+#ifndef __CHEERP__
+#include <mutex>
+#endif
+
+namespace {
+
+// Freed chunks, oldest first. The default limit is a sixteenth of the 1GB
+// linear heap of the Cheerp build, as pooled chunks that fit no new arena
+// still take their room in it.
+struct Pool {
+	std::vector<char*> begins;
+	std::vector<size_t> sizes;
+	size_t bytes{0};
+	size_t limit{64 << 20};
+#ifndef __CHEERP__
+	std::mutex mutex;
+#endif
+};
+
+Pool& pool() {
+	static Pool* p = new Pool();
+	return *p;
+}
+
+#ifndef __CHEERP__
+#define POOL_LOCK std::lock_guard<std::mutex> lock(pool().mutex)
+#else
+#define POOL_LOCK
+#endif
+
+// Takes the oldest chunks out of the pool until it holds at most keep bytes,
+// for the caller to free once the lock is released
+void evict(Pool& p, size_t keep, std::vector<char*>& freed) {
+	size_t n = 0;
+	for (; n < p.sizes.size() && p.bytes > keep; n++) {
+		freed.push_back(p.begins[n]);
+		p.bytes -= p.sizes[n];
+	}
+	p.begins.erase(p.begins.begin(), p.begins.begin() + n);
+	p.sizes.erase(p.sizes.begin(), p.sizes.begin() + n);
+}
+
+// The smallest pooled chunk of at least size bytes, or a new one. A chunk
+// more than twice as large is left in the pool, as a small arena taking the
+// chunk of a large map would report that much more capacity than it needs.
+// Before a new chunk is allocated the oldest ones are freed until the pool
+// and the new chunk fit the limit together, so that the heap can reuse their
+// memory for it rather than grow.
+char* take_chunk(size_t& size) {
+	std::vector<char*> freed;
+	{
+		POOL_LOCK;
+		Pool& p = pool();
+		size_t best = p.sizes.size();
+		for (size_t i = 0; i < p.sizes.size(); i++) {
+			if (p.sizes[i] < size || p.sizes[i] / 2 > size)
+				continue;
+			if (best == p.sizes.size() || p.sizes[i] < p.sizes[best])
+				best = i;
+		}
+		if (best != p.sizes.size()) {
+			char* begin = p.begins[best];
+			size = p.sizes[best];
+			p.bytes -= size;
+			p.begins.erase(p.begins.begin() + best);
+			p.sizes.erase(p.sizes.begin() + best);
+			return begin;
+		}
+		evict(p, p.limit > size ? p.limit - size : 0, freed);
+	}
+	for (char* begin: freed)
+		::operator delete(begin);
+	return static_cast<char*>(::operator new(size));
+}
+
+void give_chunk(char* begin, size_t size) {
+	{
+		POOL_LOCK;
+		Pool& p = pool();
+		if (p.bytes + size <= p.limit) {
+			p.begins.push_back(begin);
+			p.sizes.push_back(size);
+			p.bytes += size;
+			return;
+		}
+	}
+	::operator delete(begin);
+}
+
+}
+
+Arena::Arena(size_t size_hint) {
+	if (size_hint)
+		add_chunk(size_hint);
+}
+
+Arena::~Arena() {
+	for (const Chunk& c: chunks)
+		give_chunk(c.begin, c.size);
+}
+
+void Arena::add_chunk(size_t min_size) {
+	// Grow geometrically, so that a map that keeps allocating takes few
+	// chunks
+	size_t size = std::max(min_size, capacity_bytes / 2);
+	size = (size + Arena::CHUNK_GRANULE - 1) / Arena::CHUNK_GRANULE * Arena::CHUNK_GRANULE;
+	char* begin = take_chunk(size);
+	chunks.push_back(Chunk{begin, size});
+	top = begin;
+	limit = begin + size;
+	capacity_bytes += size;
+}
+
+void* Arena::allocate(size_t bytes, size_t align) {
+	uintptr_t at = (reinterpret_cast<uintptr_t>(top) + align - 1) & ~uintptr_t(align - 1);
+	if (!top || at + bytes > reinterpret_cast<uintptr_t>(limit)) {
+		add_chunk(bytes + align);
+		at = (reinterpret_cast<uintptr_t>(top) + align - 1) & ~uintptr_t(align - 1);
+	}
+	char* p = reinterpret_cast<char*>(at);
+	used_bytes += p + bytes - top;
+	top = p + bytes;
+	return p;
+}
+
+void Arena::deallocate(void* p, size_t bytes) {
+	if (static_cast<char*>(p) + bytes == top) {
+		top = static_cast<char*>(p);
+		used_bytes -= bytes;
+	}
+}
+
+bool Arena::extend(void* p, size_t old_bytes, size_t new_bytes) {
+	char* begin = static_cast<char*>(p);
+	if (begin + old_bytes != top || new_bytes > size_t(limit - begin))
+		return false;
+	top = begin + new_bytes;
+	used_bytes += new_bytes - old_bytes;
+	return true;
+}
+
+void Arena::set_pool_limit(size_t bytes) {
+	std::vector<char*> freed;
+	{
+		POOL_LOCK;
+		Pool& p = pool();
+		p.limit = bytes;
+		evict(p, p.limit, freed);
+	}
+	for (char* begin: freed)
+		::operator delete(begin);
+}
+
+size_t Arena::pooled_bytes() {
+	POOL_LOCK;
+	return pool().bytes;
+}
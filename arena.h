@@ -0,0 +1,234 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Memory for everything one RawMappings owns. Allocations bump a pointer
+// through a few large chunks, and the chunks are only given back all at once
+// when the arena is destroyed, which then costs the same whatever was
+// allocated. Freed chunks are kept in a pool that the next arenas take
+// theirs from, so that a long-lived process creating and destroying maps
+// keeps reusing the same blocks of the heap instead of fragmenting it.
+class Arena {
+public:
+	// Chunks are rounded up to this, so that they fit more than one size of
+	// map
+	static constexpr size_t CHUNK_GRANULE = 64 * 1024;
+
+	// The first chunk is size_hint bytes, enough for everything that is
+	// known up front
+	explicit Arena(size_t size_hint = 0);
+	~Arena();
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t bytes, size_t align);
+	// The memory is only reused if it is the last thing allocated, e.g. a
+	// temporary
+	void deallocate(void* p, size_t bytes);
+	// Grows the allocation at p from old_bytes to new_bytes without moving
+	// it, which is only possible if it is the last thing allocated and the
+	// chunk has room. Returns whether it did.
+	bool extend(void* p, size_t old_bytes, size_t new_bytes);
+	// Bytes taken from the pool or the heap, and bytes handed out of them
+	size_t capacity() const {
+		return capacity_bytes;
+	}
+	size_t used() const {
+		return used_bytes;
+	}
+
+	// Chunks freed beyond this many bytes go back to the heap, oldest first.
+	// Defaults to 64MB.
+	static void set_pool_limit(size_t bytes);
+	static size_t pooled_bytes();
+private:
+	struct Chunk {
+		char* begin;
+		size_t size;
+	};
+	void add_chunk(size_t min_size);
+
+	std::vector<Chunk> chunks;
+	char* top{nullptr};
+	char* limit{nullptr};
+	size_t capacity_bytes{0};
+	size_t used_bytes{0};
+};
+
+// A vector of trivially copyable values allocated from an arena, or from the
+// heap when it has none, so that the same containers work for data owned by a
+// RawMappings and for temporaries. While its buffer is the last allocation of
+// the arena it grows in place, so a column filled without anything else
+// allocating in between leaves no old copies of itself behind.
+template<class T>
+class ArenaVector {
+	static_assert(std::is_trivially_copyable<T>::value, "ArenaVector copies its elements as bytes");
+public:
+	using value_type = T;
+	using size_type = size_t;
+	using iterator = T*;
+	using const_iterator = const T*;
+
+	ArenaVector(Arena* arena = nullptr): arena(arena) {}
+	ArenaVector(const ArenaVector& v): arena(v.arena) {
+		assign(v.begin(), v.end());
+	}
+	// A copy of v allocated from arena, exactly as large as v
+	ArenaVector(const ArenaVector& v, Arena* arena): arena(arena) {
+		assign(v.begin(), v.end());
+	}
+	ArenaVector(ArenaVector&& v) noexcept
+		: arena(v.arena)
+		, ptr(v.ptr)
+		, length(v.length)
+		, cap(v.cap)
+	{
+		v.ptr = nullptr;
+		v.length = v.cap = 0;
+	}
+	// Assignment takes the arena of v along with its elements
+	ArenaVector& operator=(const ArenaVector& v) {
+		if (this != &v) {
+			release();
+			arena = v.arena;
+			assign(v.begin(), v.end());
+		}
+		return *this;
+	}
+	ArenaVector& operator=(ArenaVector&& v) noexcept {
+		if (this != &v) {
+			release();
+			arena = v.arena;
+			ptr = v.ptr;
+			length = v.length;
+			cap = v.cap;
+			v.ptr = nullptr;
+			v.length = v.cap = 0;
+		}
+		return *this;
+	}
+	~ArenaVector() {
+		release();
+	}
+
+	size_t size() const {
+		return length;
+	}
+	size_t capacity() const {
+		return cap;
+	}
+	bool empty() const {
+		return length == 0;
+	}
+	T* data() {
+		return ptr;
+	}
+	const T* data() const {
+		return ptr;
+	}
+	T* begin() {
+		return ptr;
+	}
+	const T* begin() const {
+		return ptr;
+	}
+	T* end() {
+		return ptr + length;
+	}
+	const T* end() const {
+		return ptr + length;
+	}
+	T& operator[](size_t i) {
+		return ptr[i];
+	}
+	const T& operator[](size_t i) const {
+		return ptr[i];
+	}
+	T& back() {
+		return ptr[length - 1];
+	}
+	const T& back() const {
+		return ptr[length - 1];
+	}
+
+	void reserve(size_t n) {
+		if (n > cap)
+			reallocate(n);
+	}
+	void push_back(const T& v) {
+		if (length == cap)
+			grow(length + 1);
+		ptr[length++] = v;
+	}
+	void pop_back() {
+		length--;
+	}
+	void resize(size_t n, const T& v = T()) {
+		if (n > cap)
+			grow(n);
+		for (size_t i = length; i < n; i++)
+			ptr[i] = v;
+		length = n;
+	}
+	void assign(size_t n, const T& v) {
+		length = 0;
+		resize(n, v);
+	}
+	void assign(const T* first, const T* last) {
+		length = 0;
+		append(first, last);
+	}
+	void append(const T* first, const T* last) {
+		size_t n = last - first;
+		if (length + n > cap)
+			grow(length + n);
+		if (n)
+			std::memcpy(ptr + length, first, n * sizeof(T));
+		length += n;
+	}
+	void clear() {
+		length = 0;
+	}
+private:
+	void grow(size_t n) {
+		reallocate(std::max(n, cap * 2));
+	}
+	void reallocate(size_t n) {
+		if (arena && ptr && arena->extend(ptr, cap * sizeof(T), n * sizeof(T))) {
+			cap = n;
+			return;
+		}
+		T* p = static_cast<T*>(arena
+			? arena->allocate(n * sizeof(T), alignof(T))
+			: ::operator new(n * sizeof(T)));
+		if (length)
+			std::memcpy(p, ptr, length * sizeof(T));
+		release();
+		ptr = p;
+		cap = n;
+	}
+	void release() {
+		if (!ptr)
+			return;
+		if (arena)
+			arena->deallocate(ptr, cap * sizeof(T));
+		else
+			::operator delete(ptr);
+		ptr = nullptr;
+		cap = 0;
+	}
+
+	Arena* arena;
+	T* ptr{nullptr};
+	size_t length{0};
+	size_t cap{0};
+};
+
+#endif
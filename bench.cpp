@@ -0,0 +1,575 @@
+// Native benchmark for the mappings parser and lookups.
+//
+// Usage: mappings-bench [--size tiny|1mb|50mb] [--iterations N] [--lookups N] [file.map ...]
+//
+// Without --size every synthetic corpus is run. Files ending in .map are
+// treated as JSON source maps and their "mappings" field is extracted, any
+// other file is read as a raw mappings string. Results are printed to stdout
+// as JSON.
+
+#include "raw_mappings.h"
+#include "comparators.h"
+#include "mappings_index.h"
+#include "compressed_mappings.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <sys/resource.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Corpus {
+	std::string name;
+	std::string mappings;
+};
+
+struct Options {
+	std::vector<std::string> sizes;
+	std::vector<std::string> files;
+	uint32_t iterations{5};
+	uint32_t lookups{1000000};
+};
+
+double elapsed_ns(Clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// The peak over the whole process so far, which never goes down, so it is
+// only reported once, for the whole run
+uint64_t peak_rss_bytes() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	// ru_maxrss is in kilobytes on Linux
+	return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+// s as the inside of a JSON string. Corpus names come from the command
+// line, so they can hold quotes, backslashes and control characters.
+std::string json_escape(const std::string& s) {
+	std::string out;
+	out.reserve(s.size());
+	for (unsigned char c: s) {
+		if (c == '"' || c == '\\') {
+			out.push_back('\\');
+			out.push_back(c);
+		} else if (c < 0x20) {
+			char escaped[8];
+			std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		} else {
+			out.push_back(c);
+		}
+	}
+	return out;
+}
+
+void vlq_append(std::string& out, int32_t value) {
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v = value < 0 ? ((-value) << 1) | 1 : value << 1;
+	do {
+		uint32_t digit = v & 31;
+		v >>= 5;
+		if (v)
+			digit |= 32;
+		out.push_back(digits[digit]);
+	} while (v);
+}
+
+// Generates a mappings string of roughly target_bytes bytes. Lines hold
+// segments_per_line segments each; pass 0 to put everything on one line,
+// which is what minifiers produce.
+std::string synthesize(size_t target_bytes, uint32_t segments_per_line, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<int32_t> column_step(1, 40);
+	std::uniform_int_distribution<int32_t> line_step(-3, 6);
+	std::uniform_int_distribution<int32_t> original_column(-30, 30);
+	std::uniform_int_distribution<uint32_t> percent(0, 99);
+	const uint32_t source_count = 64;
+	const uint32_t name_count = 4096;
+	std::uniform_int_distribution<uint32_t> pick_source(0, source_count - 1);
+	std::uniform_int_distribution<uint32_t> pick_name(0, name_count - 1);
+
+	std::string out;
+	out.reserve(target_bytes + 64);
+	int32_t source = 0;
+	int32_t original_line = 0;
+	int32_t original_col = 0;
+	int32_t name = 0;
+	uint32_t in_line = 0;
+	while (out.size() < target_bytes) {
+		if (segments_per_line != 0 && in_line == segments_per_line) {
+			out.push_back(';');
+			in_line = 0;
+		} else if (in_line != 0) {
+			out.push_back(',');
+		}
+		vlq_append(out, in_line == 0 ? column_step(rng) % 8 : column_step(rng));
+		in_line++;
+		// A few segments carry no original location at all
+		if (percent(rng) < 3)
+			continue;
+		int32_t next_source = percent(rng) < 5 ? pick_source(rng) : source;
+		vlq_append(out, next_source - source);
+		source = next_source;
+		int32_t dl = line_step(rng);
+		if (original_line + dl < 0)
+			dl = -original_line;
+		vlq_append(out, dl);
+		original_line += dl;
+		int32_t dc = original_column(rng);
+		if (original_col + dc < 0)
+			dc = -original_col;
+		vlq_append(out, dc);
+		original_col += dc;
+		if (percent(rng) < 30) {
+			int32_t next_name = pick_name(rng);
+			vlq_append(out, next_name - name);
+			name = next_name;
+		}
+	}
+	return out;
+}
+
+std::string read_file(const std::string& path) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		std::cerr << "cannot open " << path << std::endl;
+		std::exit(1);
+	}
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+// Pulls the "mappings" string out of a source map. The field never contains
+// escapes, so there is no need for a full JSON parser here.
+std::string extract_mappings(const std::string& json, const std::string& path) {
+	size_t key = json.find("\"mappings\"");
+	size_t open = key == std::string::npos ? key : json.find('"', key + 10);
+	size_t close = open == std::string::npos ? open : json.find('"', open + 1);
+	if (close == std::string::npos) {
+		std::cerr << path << ": no \"mappings\" field" << std::endl;
+		std::exit(1);
+	}
+	return json.substr(open + 1, close - open - 1);
+}
+
+bool wanted(const Options& opts, const std::string& size) {
+	if (opts.sizes.empty())
+		return true;
+	return std::find(opts.sizes.begin(), opts.sizes.end(), size) != opts.sizes.end();
+}
+
+std::vector<Corpus> build_corpus(const Options& opts) {
+	struct Spec {
+		const char* size;
+		size_t bytes;
+	};
+	const Spec specs[] = {
+		{"tiny", 1024},
+		{"1mb", 1 << 20},
+		{"50mb", 50u << 20},
+	};
+	std::vector<Corpus> corpus;
+	uint32_t seed = 1;
+	for (const Spec& spec: specs) {
+		if (!wanted(opts, spec.size))
+			continue;
+		corpus.push_back({std::string(spec.size) + "-many-lines", synthesize(spec.bytes, 24, seed++)});
+		corpus.push_back({std::string(spec.size) + "-single-line", synthesize(spec.bytes, 0, seed++)});
+	}
+	for (const std::string& path: opts.files) {
+		std::string contents = read_file(path);
+		if (path.size() > 4 && path.compare(path.size() - 4, 4, ".map") == 0)
+			contents = extract_mappings(contents, path);
+		corpus.push_back({path, std::move(contents)});
+	}
+	return corpus;
+}
+
+RawMappings* parse_or_die(const Corpus& c) {
+	std::pair<RawMappings*, Error> res = RawMappings::create(c.mappings);
+	if (res.second != Error::NoError) {
+		std::cerr << c.name << ": parse error " << res.second << std::endl;
+		std::exit(1);
+	}
+	return res.first;
+}
+
+// Keeps the optimizer from discarding lookup results
+volatile uint32_t sink;
+
+void run(const Corpus& c, const Options& opts, bool last) {
+	double best_parse_ns = 0;
+	for (uint32_t i = 0; i < opts.iterations; i++) {
+		auto start = Clock::now();
+		RawMappings* m = parse_or_die(c);
+		double ns = elapsed_ns(start);
+		delete m;
+		if (i == 0 || ns < best_parse_ns)
+			best_parse_ns = ns;
+	}
+
+	// The same input fed to a MappingsParser in network sized chunks
+	auto start = Clock::now();
+	MappingsParser parser(c.mappings.size());
+	const uint32_t chunk_size = 64 * 1024;
+	for (size_t pos = 0; pos < c.mappings.size(); pos += chunk_size) {
+		uint32_t len = std::min<size_t>(chunk_size, c.mappings.size() - pos);
+		parser.feed(c.mappings.data() + pos, len);
+	}
+	delete parser.finish().first;
+	double chunked_parse_ns = elapsed_ns(start);
+
+	start = Clock::now();
+	delete RawMappings::create_parallel(c.mappings.data(), c.mappings.size()).first;
+	double parallel_parse_ns = elapsed_ns(start);
+
+	RawMappings* m = parse_or_die(c);
+	// Where the parse time went, by the map's own account
+	MappingsTimes parse_times = m->stats().times;
+	size_t count = m->by_generated.size();
+	uint32_t lines = m->line_offsets.size() - 1;
+
+	start = Clock::now();
+	std::string encoded = m->encode();
+	double encode_ns = elapsed_ns(start);
+	size_t encoded_bytes = encoded.size();
+	encoded = std::string();
+
+	// The map composed with itself through source 0: a stand-in for a two
+	// stage pipeline
+	start = Clock::now();
+	delete RawMappings::compose(*m, 0, *m);
+	double compose_ns = elapsed_ns(start);
+
+	start = Clock::now();
+	m->compute_column_spans();
+	double column_spans_ns = elapsed_ns(start);
+
+	start = Clock::now();
+	const OriginalIndex& index = m->original_index();
+	double original_index_ns = elapsed_ns(start);
+
+	std::mt19937 rng(42);
+	uint32_t lookups = count ? opts.lookups : 0;
+	std::vector<std::pair<uint32_t, uint32_t>> generated_queries;
+	std::vector<RawMapping> original_queries;
+	generated_queries.reserve(lookups);
+	original_queries.reserve(lookups);
+	if (count) {
+		std::uniform_int_distribution<size_t> pick(0, count - 1);
+		std::uniform_int_distribution<uint32_t> jitter(0, 3);
+		for (uint32_t i = 0; i < lookups; i++) {
+			RawMapping g = m->by_generated.at(pick(rng));
+			generated_queries.emplace_back(g.generated_line, g.generated_column + jitter(rng));
+			original_queries.push_back(m->by_generated.at(pick(rng)));
+		}
+	}
+
+	start = Clock::now();
+	for (uint32_t i = 0; i < lookups; i++) {
+		sink = m->original_location_for(
+			generated_queries[i].first,
+			generated_queries[i].second,
+			i & 1 ? Bias::LeastUpperBound : Bias::GreatestLowerBound
+		);
+	}
+	double original_ns = lookups ? elapsed_ns(start) / lookups : 0;
+
+	// The same lookups through the search tree
+	start = Clock::now();
+	size_t search_tree_bytes = m->build_search_tree().byte_size();
+	double search_tree_build_ns = elapsed_ns(start);
+	start = Clock::now();
+	for (uint32_t i = 0; i < lookups; i++) {
+		sink = m->original_location_for(
+			generated_queries[i].first,
+			generated_queries[i].second,
+			i & 1 ? Bias::LeastUpperBound : Bias::GreatestLowerBound
+		);
+	}
+	double original_tree_ns = lookups ? elapsed_ns(start) / lookups : 0;
+
+	start = Clock::now();
+	for (uint32_t i = 0; i < lookups; i++) {
+		const RawMapping& q = original_queries[i];
+		uint32_t source = q.original ? q.original->source : 0;
+		uint32_t line = q.original ? q.original->line : 1;
+		uint32_t column = q.original ? q.original->column : 0;
+		sink = m->generated_location_for(
+			source,
+			line,
+			column,
+			i & 1 ? Bias::LeastUpperBound : Bias::GreatestLowerBound
+		);
+	}
+	double generated_ns = lookups ? elapsed_ns(start) / lookups : 0;
+
+	// Compressed mode: its size, and the same random lookups, each of which
+	// decodes a block
+	start = Clock::now();
+	CompressedRawMappings* compressed = CompressedRawMappings::compress(*m);
+	double compress_ns = elapsed_ns(start);
+	start = Clock::now();
+	for (uint32_t i = 0; i < lookups; i++) {
+		sink = compressed->original_location_for(
+			generated_queries[i].first,
+			generated_queries[i].second,
+			i & 1 ? Bias::LeastUpperBound : Bias::GreatestLowerBound
+		);
+	}
+	double compressed_original_ns = lookups ? elapsed_ns(start) / lookups : 0;
+	size_t compressed_bytes = compressed->byte_size();
+	delete compressed;
+
+	// Lazy mode: time to the first lookup, and the mean of up to a thousand
+	// more random ones
+	start = Clock::now();
+	LazyRawMappings* lazy = LazyRawMappings::create(c.mappings).first;
+	double lazy_create_ns = elapsed_ns(start);
+	double lazy_first_lookup_ns = 0;
+	double lazy_lookup_ns = 0;
+	uint32_t lazy_lookups = std::min<uint32_t>(lookups, 1000);
+	if (lazy_lookups) {
+		start = Clock::now();
+		sink = bool(lazy->original_location_for(
+			generated_queries[0].first,
+			generated_queries[0].second,
+			Bias::GreatestLowerBound
+		).first);
+		lazy_first_lookup_ns = elapsed_ns(start);
+		start = Clock::now();
+		for (uint32_t i = 1; i < lazy_lookups; i++) {
+			sink = bool(lazy->original_location_for(
+				generated_queries[i].first,
+				generated_queries[i].second,
+				Bias::GreatestLowerBound
+			).first);
+		}
+		lazy_lookup_ns = elapsed_ns(start) / lazy_lookups;
+	}
+	delete lazy;
+
+	// Binary index: written to a temporary file, then mapped back. The first
+	// lookups after opening include the page faults of the mapped columns.
+	start = Clock::now();
+	std::string image = serialize_index(*m);
+	double index_serialize_ns = elapsed_ns(start);
+	std::string index_path = (std::filesystem::temp_directory_path() / "mappings-bench.idx").string();
+	{
+		std::ofstream out(index_path, std::ios::binary);
+		out.write(image.data(), image.size());
+	}
+	start = Clock::now();
+	MappedMappings* mapped = MappedMappings::open(index_path.c_str()).first;
+	double index_open_ns = elapsed_ns(start);
+	double index_first_lookup_ns = 0;
+	if (lookups) {
+		start = Clock::now();
+		sink = mapped->original_location_for(
+			generated_queries[0].first,
+			generated_queries[0].second,
+			Bias::GreatestLowerBound
+		);
+		const RawMapping& q = original_queries[0];
+		sink = mapped->generated_location_for(
+			q.original ? q.original->source : 0,
+			q.original ? q.original->line : 1,
+			q.original ? q.original->column : 0,
+			Bias::GreatestLowerBound
+		);
+		index_first_lookup_ns = elapsed_ns(start);
+	}
+	delete mapped;
+	start = Clock::now();
+	delete MappedMappings::open(index_path.c_str(), true).first;
+	double index_open_verified_ns = elapsed_ns(start);
+	std::remove(index_path.c_str());
+
+	// The batched lookups only take the merged path for queries in order,
+	// e.g. from a profile or coverage dump
+	std::sort(generated_queries.begin(), generated_queries.end());
+	std::sort(original_queries.begin(), original_queries.end(), [](const RawMapping& a, const RawMapping& b) {
+		if (!a.original || !b.original)
+			return bool(b.original) && !a.original;
+		return std::tie(a.original->source, a.original->line, a.original->column)
+			< std::tie(b.original->source, b.original->line, b.original->column);
+	});
+	// The sorted queries one at a time, from scratch and through a cursor
+	start = Clock::now();
+	for (uint32_t i = 0; i < lookups; i++)
+		sink = m->original_location_for(generated_queries[i].first, generated_queries[i].second, Bias::GreatestLowerBound);
+	double original_sorted_ns = lookups ? elapsed_ns(start) / lookups : 0;
+	LookupCursor cursor;
+	start = Clock::now();
+	for (uint32_t i = 0; i < lookups; i++)
+		sink = m->original_location_for(cursor, generated_queries[i].first, generated_queries[i].second, Bias::GreatestLowerBound);
+	double original_cursor_ns = lookups ? elapsed_ns(start) / lookups : 0;
+
+	LookupBatch batch;
+	batch.resize(lookups, true);
+	for (uint32_t i = 0; i < lookups; i++) {
+		batch.lines[i] = generated_queries[i].first;
+		batch.columns[i] = generated_queries[i].second;
+	}
+	start = Clock::now();
+	m->original_locations_for(batch, Bias::GreatestLowerBound);
+	double original_batch_ns = lookups ? elapsed_ns(start) / lookups : 0;
+
+	for (uint32_t i = 0; i < lookups; i++) {
+		const RawMapping& q = original_queries[i];
+		batch.sources[i] = q.original ? q.original->source : 0;
+		batch.lines[i] = q.original ? q.original->line : 1;
+		batch.columns[i] = q.original ? q.original->column : 0;
+	}
+	start = Clock::now();
+	m->generated_locations_for(batch, Bias::GreatestLowerBound);
+	double generated_batch_ns = lookups ? elapsed_ns(start) / lookups : 0;
+
+	size_t arena_bytes = m->memory().capacity();
+	start = Clock::now();
+	delete m;
+	double destroy_ns = elapsed_ns(start);
+
+	double bytes = c.mappings.size();
+	double parse_s = best_parse_ns / 1e9;
+	std::printf(
+		"\t\t{\n"
+		"\t\t\t\"name\": \"%s\",\n"
+		"\t\t\t\"input_bytes\": %zu,\n"
+		"\t\t\t\"mappings\": %zu,\n"
+		"\t\t\t\"lines\": %u,\n"
+		"\t\t\t\"sources\": %u,\n"
+		"\t\t\t\"parse_ns\": %.0f,\n"
+		"\t\t\t\"parse_mb_per_s\": %.2f,\n"
+		"\t\t\t\"parse_mappings_per_s\": %.0f,\n"
+		"\t\t\t\"parse_decode_ns\": %llu,\n"
+		"\t\t\t\"parse_sort_ns\": %llu,\n"
+		"\t\t\t\"parse_chunked_64k_ns\": %.0f,\n"
+		"\t\t\t\"parse_parallel_ns\": %.0f,\n"
+		"\t\t\t\"parse_threads\": %u,\n"
+		"\t\t\t\"encode_ns\": %.0f,\n"
+		"\t\t\t\"encode_mb_per_s\": %.2f,\n"
+		"\t\t\t\"compose_ns\": %.0f,\n"
+		"\t\t\t\"compute_column_spans_ns\": %.0f,\n"
+		"\t\t\t\"original_index_ns\": %.0f,\n"
+		"\t\t\t\"lookups\": %u,\n"
+		"\t\t\t\"original_location_for_ns\": %.1f,\n"
+		"\t\t\t\"search_tree_build_ns\": %.0f,\n"
+		"\t\t\t\"search_tree_bytes\": %zu,\n"
+		"\t\t\t\"original_location_for_tree_ns\": %.1f,\n"
+		"\t\t\t\"generated_location_for_ns\": %.1f,\n"
+		"\t\t\t\"compress_ns\": %.0f,\n"
+		"\t\t\t\"compressed_bytes\": %zu,\n"
+		"\t\t\t\"compressed_original_location_for_ns\": %.1f,\n"
+		"\t\t\t\"lazy_create_ns\": %.0f,\n"
+		"\t\t\t\"lazy_first_lookup_ns\": %.0f,\n"
+		"\t\t\t\"lazy_lookup_ns\": %.0f,\n"
+		"\t\t\t\"index_bytes\": %zu,\n"
+		"\t\t\t\"index_serialize_ns\": %.0f,\n"
+		"\t\t\t\"index_open_ns\": %.0f,\n"
+		"\t\t\t\"index_open_verified_ns\": %.0f,\n"
+		"\t\t\t\"index_first_lookup_ns\": %.0f,\n"
+		"\t\t\t\"original_location_for_sorted_ns\": %.1f,\n"
+		"\t\t\t\"original_location_for_sorted_cursor_ns\": %.1f,\n"
+		"\t\t\t\"original_locations_for_sorted_batch_ns\": %.1f,\n"
+		"\t\t\t\"generated_locations_for_sorted_batch_ns\": %.1f,\n"
+		"\t\t\t\"arena_bytes\": %zu,\n"
+		"\t\t\t\"destroy_ns\": %.0f\n"
+		"\t\t}%s\n",
+		json_escape(c.name).c_str(),
+		c.mappings.size(),
+		count,
+		lines,
+		index.source_count(),
+		best_parse_ns,
+		parse_s > 0 ? bytes / (1 << 20) / parse_s : 0,
+		parse_s > 0 ? count / parse_s : 0,
+		static_cast<unsigned long long>(parse_times.decode_ns),
+		static_cast<unsigned long long>(parse_times.sort_ns),
+		chunked_parse_ns,
+		parallel_parse_ns,
+		std::thread::hardware_concurrency(),
+		encode_ns,
+		encode_ns > 0 ? encoded_bytes / double(1 << 20) / (encode_ns / 1e9) : 0,
+		compose_ns,
+		column_spans_ns,
+		original_index_ns,
+		lookups,
+		original_ns,
+		search_tree_build_ns,
+		search_tree_bytes,
+		original_tree_ns,
+		generated_ns,
+		compress_ns,
+		compressed_bytes,
+		compressed_original_ns,
+		lazy_create_ns,
+		lazy_first_lookup_ns,
+		lazy_lookup_ns,
+		image.size(),
+		index_serialize_ns,
+		index_open_ns,
+		index_open_verified_ns,
+		index_first_lookup_ns,
+		original_sorted_ns,
+		original_cursor_ns,
+		original_batch_ns,
+		generated_batch_ns,
+		arena_bytes,
+		destroy_ns,
+		last ? "" : ","
+	);
+	std::fflush(stdout);
+}
+
+[[noreturn]]
+void usage(const char* argv0) {
+	std::cerr << "usage: " << argv0
+		<< " [--size tiny|1mb|50mb] [--iterations N] [--lookups N] [file ...]" << std::endl;
+	std::exit(2);
+}
+
+}
+
+int main(int argc, char** argv) {
+	Options opts;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--size" && i + 1 < argc) {
+			opts.sizes.push_back(argv[++i]);
+		} else if (arg == "--iterations" && i + 1 < argc) {
+			opts.iterations = std::max(1, std::atoi(argv[++i]));
+		} else if (arg == "--lookups" && i + 1 < argc) {
+			opts.lookups = std::max(0, std::atoi(argv[++i]));
+		} else if (arg.size() > 1 && arg[0] == '-') {
+			usage(argv[0]);
+		} else {
+			opts.files.push_back(arg);
+		}
+	}
+
+	std::vector<Corpus> corpus = build_corpus(opts);
+	std::printf("{\n\t\"benchmarks\": [\n");
+	for (size_t i = 0; i < corpus.size(); i++) {
+		run(corpus[i], opts, i + 1 == corpus.size());
+		// Free the input as soon as it is done with, so that peak RSS is not
+		// dominated by inputs still waiting to be run.
+		std::string().swap(corpus[i].mappings);
+	}
+	std::printf("\t],\n\t\"peak_rss_bytes\": %llu\n}\n",
+		static_cast<unsigned long long>(peak_rss_bytes()));
+	return 0;
+}
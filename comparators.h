@@ -4,137 +4,102 @@
 #include "raw_mappings.h"
 #include "utils.h"
 
-inline bool operator<(const OriginalLocation& o1, const OriginalLocation& o2) {
-	return std::tie(
-		o1.source,
-		o1.line,
-		o1.column
-		//o1.name
-	) < std::tie(
-		o2.source,
-		o2.line,
-		o2.column
-		//o2.name
-	);
-}
+#include <tuple>
+
 namespace cmp {
 
+// The comparators order indices into a MappingColumns, and only read the
+// columns they compare. Each one is By<> over a key extractor, which packs
+// the fields it compares into integers so that comparing two mappings is
+// comparing their keys. The searches take keys made with pack() as well,
+// and extractors can compare a mapping to one of those without building
+// its whole key.
 
-// NOTE: All the ByOriginalLocation... assume that r.original.has_value() == true
-struct ByOriginalLocationOnly {
-	inline bool operator()(const RawMapping& r1, const RawMapping& r2) {
-		const OriginalLocation& o1 = *r1.original;
-		const OriginalLocation& o2 = *r2.original;
-		return o1 < o2;
+// The original (line, column) of a mapping, for the mappings of one source
+// NOTE: assumes that has_original[i] == true
+struct OriginalLineColumn {
+	using Key = uint64_t;
+	const uint32_t* line;
+	const uint32_t* column;
+	explicit OriginalLineColumn(const MappingColumns* m)
+		: line(m->original_line.data()), column(m->original_column.data()) {}
+	OriginalLineColumn(const uint32_t* line, const uint32_t* column)
+		: line(line), column(column) {}
+	static Key pack(uint32_t original_line, uint32_t original_column) {
+		return uint64_t(original_line) << 32 | original_column;
 	}
-};
-struct ByOriginalLocationSameSource {
-	inline bool operator()(const RawMapping& r1, const RawMapping& r2) {
-		const OriginalLocation& o1 = *r1.original;
-		const OriginalLocation& o2 = *r2.original;
-		return std::tie(
-			o1.line,
-			o1.column,
-			r1.generated_line,
-			r1.generated_column
-		) < std::tie(
-			o2.line,
-			o2.column,
-			r2.generated_line,
-			r2.generated_column
-		);
+	Key operator()(uint32_t i) const {
+		return pack(line[i], column[i]);
 	}
-};
-struct ByOriginalLocationLineColumn {
-	inline bool operator()(const RawMapping& r1, const RawMapping& r2) {
-		const OriginalLocation& o1 = *r1.original;
-		const OriginalLocation& o2 = *r2.original;
-		return std::tie(
-			o1.line,
-			o1.column
-		) < std::tie(
-			o2.line,
-			o2.column
-		);
+	// The column is only read when the lines are the same, which saves a
+	// cache miss on most probes of a search
+	bool before(uint32_t i, Key k) const {
+		uint32_t l = k >> 32;
+		return line[i] != l ? line[i] < l : column[i] < uint32_t(k);
 	}
-};
-struct ByGeneratedLocationOnly {
-	inline bool operator()(const RawMapping& r1, const RawMapping& r2) const {
-		return std::tie(
-			r1.generated_line,
-			r1.generated_column
-		) < std::tie(
-			r2.generated_line,
-			r2.generated_column
-		);
+	bool after(uint32_t i, Key k) const {
+		uint32_t l = k >> 32;
+		return line[i] != l ? line[i] > l : column[i] > uint32_t(k);
 	}
 };
-struct ByGeneratedLocation {
-	inline bool operator()(const RawMapping& r1, const RawMapping& r2) const {
-		return std::tie(
-			r1.generated_line,
-			r1.generated_column,
-			r1.original
-		) < std::tie(
-			r2.generated_line,
-			r2.generated_column,
-			r2.original
-		);
+
+// Everything but the generated line, to order the mappings of one line.
+// Mappings without an original location sort first, as std::optional does,
+// and since their fields are all 0 they compare equal to each other. Names
+// only break ties, so that sorting a line that is already sorted never
+// reorders it.
+struct GeneratedTail {
+	struct Key {
+		// generated_column << 1 | has_original
+		uint64_t column;
+		// source << 32 | original_line
+		uint64_t source_line;
+		// original_column << 1 | has_name
+		uint64_t original_column;
+		uint32_t name;
+		bool operator<(const Key& k) const {
+			return std::tie(column, source_line, original_column, name)
+				< std::tie(k.column, k.source_line, k.original_column, k.name);
+		}
+	};
+	const MappingColumns* m;
+	explicit GeneratedTail(const MappingColumns* m): m(m) {}
+	Key operator()(uint32_t i) const {
+		return Key{
+			uint64_t(m->generated_column[i]) << 1 | m->has_original[i],
+			uint64_t(m->source[i]) << 32 | m->original_line[i],
+			uint64_t(m->original_column[i]) << 1 | m->has_name[i],
+			m->name[i],
+		};
 	}
-};
-struct ByGeneratedLocationTail {
-	inline bool operator()(const RawMapping& r1, const RawMapping& r2) const {
-		return std::tie(
-			r1.generated_column,
-			r1.original
-		) < std::tie(
-			r2.generated_column,
-			r2.original
-		);
+	bool before(uint32_t i, const Key& k) const {
+		return (*this)(i) < k;
+	}
+	bool after(uint32_t i, const Key& k) const {
+		return k < (*this)(i);
 	}
 };
 
-struct Comparator {
-	enum class Mode {
-		ByGeneratedLocation,
-		ByGeneratedLocationOnly,
-		ByGeneratedLocationTail,
-		ByOriginalLocationSameSource,
-		ByOriginalLocationLineColumn,
-		ByOriginalLocationOnly,
-	};
-	Mode mode;
-	Comparator(Mode m = Mode::ByOriginalLocationSameSource): mode(m) {}
-	bool operator()(const RawMapping& m1, const RawMapping& m2) const {
-		switch (mode) {
-		case Mode::ByGeneratedLocationOnly: {
-			ByGeneratedLocationOnly cmp;
-			return cmp(m1,m2);
-		}
-		case Mode::ByGeneratedLocation: {
-			ByGeneratedLocation cmp;
-			return cmp(m1,m2);
-		}
-		case Mode::ByGeneratedLocationTail: {
-			ByGeneratedLocationTail cmp;
-			return cmp(m1,m2);
-		}
-		case Mode::ByOriginalLocationOnly: {
-			ByOriginalLocationOnly cmp;
-			return cmp(m1,m2);
-		}
-		case Mode::ByOriginalLocationSameSource: {
-			ByOriginalLocationSameSource cmp;
-			return cmp(m1,m2);
-		}
-		case Mode::ByOriginalLocationLineColumn: {
-			ByOriginalLocationLineColumn cmp;
-			return cmp(m1,m2);
-		}
-		}
+template<class KeyOf>
+struct By {
+	using Key = typename KeyOf::Key;
+	KeyOf key_of;
+	template<class... Args>
+	explicit By(Args... args): key_of(args...) {}
+	bool operator()(uint32_t i1, uint32_t i2) const {
+		return key_of(i1) < key_of(i2);
+	}
+	bool operator()(uint32_t i, const Key& k) const {
+		return key_of.before(i, k);
+	}
+	bool operator()(const Key& k, uint32_t i) const {
+		return key_of.after(i, k);
 	}
 };
 
+using ByOriginalLocationLineColumn = By<OriginalLineColumn>;
+using ByGeneratedLocationTail = By<GeneratedTail>;
+
 }
 
 #endif
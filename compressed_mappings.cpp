@@ -0,0 +1,343 @@
+#include "compressed_mappings.h"
+
+#include <algorithm>
+
+namespace {
+
+uint32_t bit_width(uint64_t v) {
+	uint32_t width = 0;
+	for (; v; v >>= 1)
+		width++;
+	return width;
+}
+
+// Small deltas of either sign become small unsigned values
+uint64_t zigzag(int64_t v) {
+	return v < 0 ? (uint64_t(-v) << 1) - 1 : uint64_t(v) << 1;
+}
+
+int64_t unzigzag(uint64_t v) {
+	return v & 1 ? -int64_t((v + 1) >> 1) : int64_t(v >> 1);
+}
+
+// Appends values of up to 64 bits to words, bit 0 of a value first and
+// straddling two words when it does not fit in the last one
+class BitWriter {
+public:
+	explicit BitWriter(std::vector<uint64_t>& words): words(words) {}
+	void put(uint64_t value, uint32_t width) {
+		if (!width)
+			return;
+		if (used == 0)
+			words.push_back(0);
+		words.back() |= value << used;
+		if (used + width > 64)
+			words.push_back(value >> (64 - used));
+		used = (used + width) % 64;
+	}
+	// The next value starts on a new word
+	void align() {
+		used = 0;
+	}
+private:
+	std::vector<uint64_t>& words;
+	// The bits of the last word in use, 0 when it is full
+	uint32_t used{0};
+};
+
+// Reads n values of width bits from bit pos of words on, and moves pos past
+// them. The word after the last value must be readable, and the values must
+// fit in T.
+template<class T>
+void unpack(const uint64_t* words, uint64_t& pos, uint32_t width, uint32_t n, T* out) {
+	if (!width) {
+		std::fill(out, out + n, 0);
+		return;
+	}
+	uint64_t mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+	for (uint32_t k = 0; k < n; k++, pos += width) {
+		const uint64_t* w = words + pos / 64;
+		uint32_t shift = pos % 64;
+		// Shifting by 64 - shift in two steps keeps shift == 0 defined
+		out[k] = ((w[0] >> shift) | ((w[1] << 1) << (63 - shift))) & mask;
+	}
+}
+
+}
+
+CompressedRawMappings* CompressedRawMappings::compress(const RawMappings& m) {
+	const MappingColumns& c = m.by_generated;
+	CompressedRawMappings* ret = new CompressedRawMappings();
+	ret->mapping_count = c.size();
+	ret->column_spans = m.computed_column_spans;
+	uint32_t block_count = (c.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	ret->blocks.reserve(block_count);
+	ret->first_keys.reserve(block_count);
+	// About 40 bits a mapping on real maps
+	ret->packed.reserve(uint64_t(c.size()) * 40 / 64);
+	BitWriter out(ret->packed);
+
+	// The values of the mappings before, which the deltas are from
+	uint32_t prev[FieldCount] = {};
+	uint64_t deltas[FieldCount][BLOCK_SIZE];
+	for (uint32_t b = 0; b < block_count; b++) {
+		uint32_t first = b * BLOCK_SIZE;
+		uint32_t n = ret->block_size(b);
+		Block block;
+		block.first_word = ret->packed.size();
+		prev[GeneratedLine] = c.generated_line[first];
+		prev[GeneratedColumn] = c.generated_column[first];
+		std::copy(prev, prev + FieldCount, block.base);
+		ret->first_keys.push_back(uint64_t(c.generated_line[first]) << 32 | c.generated_column[first]);
+
+		// The deltas of each field, counted in counts[field], and the
+		// union of their bits, which is as wide as the widest
+		uint32_t counts[FieldCount] = {};
+		uint64_t bits[FieldCount] = {};
+		auto add = [&](Field f, uint64_t delta) {
+			deltas[f][counts[f]++] = delta;
+			bits[f] |= delta;
+		};
+		for (uint32_t i = first; i < first + n; i++) {
+			uint32_t line = c.generated_line[i];
+			uint32_t column = c.generated_column[i];
+			add(GeneratedLine, line - prev[GeneratedLine]);
+			add(GeneratedColumn, line != prev[GeneratedLine] ? column : column - prev[GeneratedColumn]);
+			prev[GeneratedLine] = line;
+			prev[GeneratedColumn] = column;
+			if (!c.has_original[i])
+				continue;
+			const uint32_t values[] = {c.source[i], c.original_line[i], c.original_column[i]};
+			for (uint32_t f = Source; f <= OriginalColumn; f++) {
+				add(Field(f), zigzag(int64_t(values[f - Source]) - prev[f]));
+				prev[f] = values[f - Source];
+			}
+			if (c.has_name[i]) {
+				add(Name, zigzag(int64_t(c.name[i]) - prev[Name]));
+				prev[Name] = c.name[i];
+			}
+		}
+		for (uint32_t f = 0; f < FieldCount; f++)
+			block.width[f] = bit_width(bits[f]);
+		uint32_t originals = counts[Source];
+		uint32_t names = counts[Name];
+		block.has_original = originals == 0 ? NoneSet : originals == n ? AllSet : OneBitEach;
+		block.has_name = names == 0 ? NoneSet : names == originals ? AllSet : OneBitEach;
+
+		auto put_field = [&](Field f) {
+			for (uint32_t k = 0; k < counts[f]; k++)
+				out.put(deltas[f][k], block.width[f]);
+		};
+		put_field(GeneratedLine);
+		put_field(GeneratedColumn);
+		if (block.has_original == OneBitEach) {
+			for (uint32_t i = first; i < first + n; i++)
+				out.put(c.has_original[i], 1);
+		}
+		put_field(Source);
+		put_field(OriginalLine);
+		put_field(OriginalColumn);
+		if (block.has_name == OneBitEach) {
+			for (uint32_t i = first; i < first + n; i++) {
+				if (c.has_original[i])
+					out.put(c.has_name[i], 1);
+			}
+		}
+		put_field(Name);
+		out.align();
+		ret->blocks.push_back(block);
+	}
+	ret->packed.push_back(0);
+	ret->packed.shrink_to_fit();
+	return ret;
+}
+
+std::pair<CompressedRawMappings*, Error> CompressedRawMappings::create(const char* input, uint32_t length) {
+	std::pair<RawMappings*, Error> res = RawMappings::create(input, length);
+	std::unique_ptr<RawMappings> m(res.first);
+	if (res.second != Error::NoError)
+		return std::make_pair(nullptr, res.second);
+	return std::make_pair(compress(*m), Error::NoError);
+}
+
+size_t CompressedRawMappings::byte_size() const {
+	return blocks.capacity() * sizeof(Block)
+		+ (first_keys.capacity() + packed.capacity()) * sizeof(uint64_t)
+		+ (cache ? CACHED_BLOCKS * sizeof(DecodedBlock) : 0);
+}
+
+void CompressedRawMappings::decode_positions(uint32_t b, DecodedBlock& out) const {
+	const Block& block = blocks[b];
+	uint32_t n = block_size(b);
+	const uint64_t* words = packed.data() + block.first_word;
+	uint64_t pos = 0;
+	out.block = b;
+	out.size = n;
+	out.complete = false;
+
+	uint32_t* lines = out.fields[GeneratedLine];
+	unpack(words, pos, block.width[GeneratedLine], n, lines);
+	uint32_t line = block.base[GeneratedLine];
+	for (uint32_t k = 0; k < n; k++) {
+		line += lines[k];
+		lines[k] = line;
+	}
+	uint32_t* columns = out.fields[GeneratedColumn];
+	unpack(words, pos, block.width[GeneratedColumn], n, columns);
+	uint32_t column = block.base[GeneratedColumn];
+	line = block.base[GeneratedLine];
+	for (uint32_t k = 0; k < n; k++) {
+		column = lines[k] != line ? columns[k] : column + columns[k];
+		line = lines[k];
+		columns[k] = column;
+	}
+
+	uint32_t bits[BLOCK_SIZE];
+	if (block.has_original == OneBitEach)
+		unpack(words, pos, 1, n, bits);
+	for (uint32_t k = 0; k < n; k++)
+		out.has_original[k] = block.has_original == OneBitEach ? bits[k] : block.has_original == AllSet;
+	out.originals_pos = pos;
+}
+
+void CompressedRawMappings::decode_originals(DecodedBlock& out) const {
+	const Block& block = blocks[out.block];
+	uint32_t n = out.size;
+	const uint64_t* words = packed.data() + block.first_word;
+	uint64_t pos = out.originals_pos;
+	uint32_t originals = std::count(out.has_original, out.has_original + n, true);
+
+	// The deltas are only stored for the mappings that have the field, and
+	// absent fields are 0, as in MappingColumns. Zigzag encoded, they can
+	// take 33 bits.
+	uint64_t deltas[BLOCK_SIZE];
+	for (uint32_t f = Source; f <= OriginalColumn; f++) {
+		unpack(words, pos, block.width[f], originals, deltas);
+		uint32_t value = block.base[f];
+		for (uint32_t k = 0, j = 0; k < n; k++) {
+			if (out.has_original[k])
+				value += unzigzag(deltas[j++]);
+			out.fields[f][k] = out.has_original[k] ? value : 0;
+		}
+	}
+	if (block.has_name == OneBitEach)
+		unpack(words, pos, 1, originals, deltas);
+	uint32_t names = 0;
+	for (uint32_t k = 0, j = 0; k < n; k++) {
+		out.has_name[k] = false;
+		if (out.has_original[k]) {
+			out.has_name[k] = block.has_name == OneBitEach ? deltas[j++] : block.has_name == AllSet;
+			names += out.has_name[k];
+		}
+	}
+	unpack(words, pos, block.width[Name], names, deltas);
+	uint32_t name = block.base[Name];
+	for (uint32_t k = 0, j = 0; k < n; k++) {
+		if (out.has_name[k])
+			name += unzigzag(deltas[j++]);
+		out.fields[Name][k] = out.has_name[k] ? name : 0;
+	}
+	out.complete = true;
+}
+
+const CompressedRawMappings::DecodedBlock& CompressedRawMappings::decoded(uint32_t b, bool complete) {
+	if (!cache) {
+		cache.reset(new DecodedBlock[CACHED_BLOCKS]);
+		for (uint32_t i = 0; i < CACHED_BLOCKS; i++)
+			cache[i].block = RawMappings::npos;
+	}
+	DecodedBlock& d = cache[b % CACHED_BLOCKS];
+	if (d.block != b) {
+		decode_positions(b, d);
+		decodes++;
+	}
+	if (complete && !d.complete)
+		decode_originals(d);
+	return d;
+}
+
+RawMapping CompressedRawMappings::at(uint32_t i) {
+	const DecodedBlock& d = decoded(i / BLOCK_SIZE, true);
+	uint32_t k = i % BLOCK_SIZE;
+	RawMapping m;
+	m.generated_line = d.fields[GeneratedLine][k];
+	m.generated_column = d.fields[GeneratedColumn][k];
+	if (d.has_original[k]) {
+		OriginalLocation o;
+		o.source = d.fields[Source][k];
+		o.line = d.fields[OriginalLine][k];
+		o.column = d.fields[OriginalColumn][k];
+		if (d.has_name[k])
+			o.name = d.fields[Name][k];
+		m.original = o;
+	}
+	if (column_spans && i + 1 < mapping_count) {
+		// The next mapping is the first of the next block, if not in this one
+		uint64_t next = k + 1 < d.size
+			? uint64_t(d.fields[GeneratedLine][k + 1]) << 32 | d.fields[GeneratedColumn][k + 1]
+			: first_keys[i / BLOCK_SIZE + 1];
+		if (next >> 32 == m.generated_line)
+			m.last_generated_column = uint32_t(next) - 1;
+	}
+	return m;
+}
+
+uint32_t CompressedRawMappings::original_location_for(
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+) {
+	if (!mapping_count)
+		return RawMappings::npos;
+	// Mappings are sorted by (line, column), so the bound over the whole
+	// map is the bound over the line
+	uint64_t key = uint64_t(generated_line) << 32 | generated_column;
+	auto key_at = [](const DecodedBlock& d, uint32_t k) {
+		return uint64_t(d.fields[GeneratedLine][k]) << 32 | d.fields[GeneratedColumn][k];
+	};
+	uint32_t idx;
+	if (bias == Bias::GreatestLowerBound) {
+		// The last block that starts at or before key has the last mapping
+		// not after it
+		uint32_t b = std::upper_bound(first_keys.begin(), first_keys.end(), key) - first_keys.begin();
+		if (b == 0)
+			return RawMappings::npos;
+		const DecodedBlock& d = decoded(--b, false);
+		uint32_t lo = 1;
+		uint32_t hi = d.size;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (key_at(d, mid) <= key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		idx = b * BLOCK_SIZE + lo - 1;
+	} else {
+		// The first mapping not before key is in the last block that starts
+		// before key, or is the first of the block after
+		uint32_t b = std::lower_bound(first_keys.begin(), first_keys.end(), key) - first_keys.begin();
+		if (b == 0) {
+			idx = 0;
+		} else {
+			const DecodedBlock& d = decoded(--b, false);
+			uint32_t lo = 1;
+			uint32_t hi = d.size;
+			while (lo < hi) {
+				uint32_t mid = lo + (hi - lo) / 2;
+				if (key_at(d, mid) < key)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			idx = b * BLOCK_SIZE + lo;
+			if (idx == mapping_count)
+				return RawMappings::npos;
+		}
+	}
+	const DecodedBlock& d = decoded(idx / BLOCK_SIZE, false);
+	uint32_t k = idx % BLOCK_SIZE;
+	if (d.fields[GeneratedLine][k] != generated_line || !d.has_original[k])
+		return RawMappings::npos;
+	return idx;
+}
@@ -0,0 +1,122 @@
+#ifndef _COMPRESSED_MAPPINGS_H_
+#define _COMPRESSED_MAPPINGS_H_
+
+#include "raw_mappings.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Mappings kept delta encoded and bit packed, for the many maps that are
+// loaded but rarely looked up, at a fraction of the memory of RawMappings.
+//
+// The mappings are split into blocks of BLOCK_SIZE in generated order. Each
+// field of a block is stored as deltas from the mapping before, each taking
+// as many bits as the largest of them in the block: the generated line, the
+// generated column (from the start of the line on a new line), then source,
+// original line, original column and name for the mappings that have them,
+// zigzag encoded. The position of the first mapping of every block is kept
+// apart as a sparse index, so a lookup binary searches that and then decodes
+// a single block, and only decodes the original fields of a block when a
+// mapping of it is read. The last few blocks decoded are cached.
+//
+// The cache takes about 13KB once a map is looked up, whatever its size, so
+// this only pays off for maps of more than a few thousand mappings. A 1KB
+// mappings string takes 14KB compressed, of which the packed mappings are a
+// few hundred bytes.
+class CompressedRawMappings {
+public:
+	static constexpr uint32_t BLOCK_SIZE = 128;
+	// Decoded blocks kept, each in the slot of its number modulo this
+	static constexpr uint32_t CACHED_BLOCKS = 4;
+
+	static CompressedRawMappings* compress(const RawMappings& m);
+	// Parses into a RawMappings first, so this takes as much memory for a
+	// while as create() does
+	static std::pair<CompressedRawMappings*, Error> create(const char* input, uint32_t length);
+
+	uint32_t size() const {
+		return mapping_count;
+	}
+	bool has_column_spans() const {
+		return column_spans;
+	}
+	// Everything held, the decoded blocks included
+	size_t byte_size() const;
+	// How many times a block had to be decoded
+	uint64_t decoded_block_count() const {
+		return decodes;
+	}
+	RawMapping at(uint32_t i);
+	// Same as RawMappings::original_location_for
+	uint32_t original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	);
+private:
+	enum Field {
+		GeneratedLine,
+		GeneratedColumn,
+		Source,
+		OriginalLine,
+		OriginalColumn,
+		Name,
+		FieldCount
+	};
+	// How a flag is stored for the mappings of a block
+	enum FlagMode: uint8_t {
+		NoneSet,
+		AllSet,
+		OneBitEach,
+	};
+	struct Block {
+		// Where the bits of the block start in packed
+		uint32_t first_word;
+		// The values the deltas start from, i.e. those of the last mapping
+		// before the block that has each field
+		uint32_t base[FieldCount];
+		uint8_t width[FieldCount];
+		FlagMode has_original;
+		FlagMode has_name;
+	};
+	struct DecodedBlock {
+		uint32_t block;
+		uint32_t size;
+		// Whether fields has more than the generated line and column
+		bool complete;
+		// Where the bits of the original fields start
+		uint64_t originals_pos;
+		uint32_t fields[FieldCount][BLOCK_SIZE];
+		bool has_original[BLOCK_SIZE];
+		bool has_name[BLOCK_SIZE];
+	};
+
+	CompressedRawMappings() = default;
+	// The generated positions and has_original of a block, and the rest
+	// too if complete
+	const DecodedBlock& decoded(uint32_t block, bool complete);
+	void decode_positions(uint32_t block, DecodedBlock& out) const;
+	void decode_originals(DecodedBlock& out) const;
+	uint32_t block_size(uint32_t block) const {
+		return std::min(BLOCK_SIZE, mapping_count - block * BLOCK_SIZE);
+	}
+
+	uint32_t mapping_count{0};
+	bool column_spans{false};
+	std::vector<Block> blocks;
+	// The generated line and column of the first mapping of each block,
+	// packed as line << 32 | column
+	std::vector<uint64_t> first_keys;
+	// The bits of each block, which starts on a new word, and a word of
+	// padding so that any value can be read as two words
+	std::vector<uint64_t> packed;
+	// Allocated by the first lookup, so that cold maps do not pay for it
+	std::unique_ptr<DecodedBlock[]> cache;
+	uint64_t decodes{0};
+};
+
+#endif
@@ -1,9 +1,13 @@
 #include "raw_mappings.h"
+#include "mappings_cache.h"
+#include "compressed_mappings.h"
 #include "comparators.h"
 
 #include <algorithm>
 #include <memory>
 #include <cstring>
+#include <initializer_list>
+#include <limits>
 #include <cheerp/client.h>
 
 enum class Order {
@@ -18,6 +22,82 @@ namespace [[cheerp::genericjs]] client {
 	};
 }
 
+// A buffer in the linear heap for the raw bytes of a mappings string, e.g.
+// filled straight from fetch() or fs.readFile(), that Mappings can parse in
+// place.
+class [[cheerp::jsexport]] [[cheerp::genericjs]] MappingsInput {
+public:
+	static MappingsInput* create(uint32_t length) {
+		return new MappingsInput(InputBuffer::create(length));
+	}
+	// A view of the buffer to write the input into. Get a fresh one after
+	// anything else has allocated, since growing the heap detaches it.
+	client::Uint8Array* bytes() {
+		return cheerp::MakeTypedArray(buf->data(), buf->size());
+	}
+	void destroy() {
+		if (buf) {
+			delete buf;
+			buf = nullptr;
+		}
+	}
+private:
+	MappingsInput(InputBuffer* buf): buf(buf) {}
+	InputBuffer* buf;
+
+	friend class Mappings;
+	friend class MappingsStream;
+};
+
+class Mappings;
+class MappingsCursor;
+
+// Parses a mappings string chunk by chunk as it arrives, so that parsing
+// overlaps with the download. Chunks can be split anywhere.
+class [[cheerp::jsexport]] [[cheerp::genericjs]] MappingsStream {
+public:
+	static MappingsStream* create() {
+		return new MappingsStream(MappingsParser::create());
+	}
+	void feed_string(const client::String* js_chunk) {
+		std::string chunk(*js_chunk);
+		check(parser_or_throw()->feed(chunk.data(), chunk.size()));
+	}
+	// Feeds the first `length` bytes of a MappingsInput, which can be
+	// refilled with the next chunk as soon as this returns
+	void feed_input(MappingsInput* input, uint32_t length) {
+		if (!input->buf || length > input->buf->size())
+			throw_string("Invalid MappingsInput");
+		check(parser_or_throw()->feed(input->buf->data(), length));
+	}
+	// Parses the last partial segment and returns the finished mappings.
+	// The stream is destroyed in the process.
+	Mappings* finish(
+		client::TArray<client::String>* sources,
+		client::TArray<client::String>* names
+	);
+	void destroy() {
+		if (parser) {
+			delete parser;
+			parser = nullptr;
+		}
+	}
+private:
+	MappingsStream(MappingsParser* parser): parser(parser) {}
+	MappingsParser* parser_or_throw() {
+		if (!parser)
+			throw_string("MappingsStream has already been finished or destroyed");
+		return parser;
+	}
+	void check(Error err) {
+		if (err != Error::NoError) {
+			destroy();
+			throw_error(err);
+		}
+	}
+	MappingsParser* parser;
+};
+
 class [[cheerp::jsexport]] [[cheerp::genericjs]] Mappings {
 public:
 	static Mappings* create(
@@ -26,138 +106,241 @@ public:
 			client::TArray<client::String>* names
 		) {
 		std::string input(*js_input);
-		std::pair<RawMappings*, Error> res = RawMappings::create(std::move(input));
+		std::pair<RawMappings*, Error> res = RawMappings::create(input);
+		if (res.second == Error::NoError)
+			return new Mappings(res.first, sources, names);
+		else
+			throw_error(res.second);
+	}
+	// Like create(), but parses the bytes of a MappingsInput in place instead
+	// of transcoding and copying a JS string. The input can be destroyed
+	// as soon as this returns.
+	static Mappings* create_from_input(
+			MappingsInput* input,
+			client::TArray<client::String>* sources,
+			client::TArray<client::String>* names
+		) {
+		if (!input->buf)
+			throw_string("MappingsInput has been destroyed");
+		std::pair<RawMappings*, Error> res = RawMappings::create(
+			input->buf->data(),
+			input->buf->size()
+		);
 		if (res.second == Error::NoError)
 			return new Mappings(res.first, sources, names);
 		else
 			throw_error(res.second);
 	}
+	// Chains this map with inner, the map of its source number source,
+	// returning a map from this map's generated file to inner's sources and
+	// names. Mappings into other sources are left without an original
+	// location.
+	Mappings* compose(Mappings* inner, uint32_t source) {
+		return new Mappings(RawMappings::compose(*ptr, source, *inner->ptr), inner->sources, inner->names);
+	}
 	void compute_column_spans() {
 		ptr->compute_column_spans();
 	}
+	// Speeds up original_location_for on maps with very long lines, such as
+	// minified bundles
+	void build_search_tree() {
+		ptr->build_search_tree();
+	}
 	client::Object* original_location_for(
 		uint32_t generated_line,
 		uint32_t generated_column,
 		Bias bias
 	) {
-		const RawMapping* raw = ptr->original_location_for(
+		return original_location(ptr->original_location_for(
 			generated_line,
 			generated_column,
 			bias
-		);
-		client::Object* line = nullptr;
-		client::Object* column = nullptr;
-		client::String* name = nullptr;
-		client::String* source = nullptr;
-		if (raw!=nullptr && raw->original) {
-			const auto& orig = raw->original;
-			line = nullable<double>(orig->line);
-			column = nullable<double>(orig->column);
-			if (orig->name)
-				name = names->at(*orig->name);
-			source = sources->at(orig->source);
-		}
-		return CHEERP_OBJECT(line, column, name, source);
+		));
 	}
+	// For original_location_for queries that come in order or cluster
+	// around a few places, e.g. a profile replayed in time order or the
+	// frames of a hot function: a cursor searches from where its previous
+	// query ended instead of from scratch. Destroy it when done.
+	MappingsCursor* cursor();
 	client::Object* generated_location_for(
 		uint32_t source,
 		uint32_t original_line,
 		uint32_t original_column,
 		Bias bias
 	) {
-		const RawMapping* raw = ptr->generated_location_for(
+		uint32_t idx = ptr->generated_location_for(
 			source,
 			original_line,
 			original_column,
 			bias
 		);
+		const MappingColumns& m = ptr->by_generated;
 		client::Object* line = nullptr;
 		client::Object* column = nullptr;
 		client::Object* lastColumn = nullptr;
-		if (raw != nullptr) {
-			line = nullable<double>(raw->generated_line);
-			column =nullable<double>(raw->generated_column);
-			if (raw->last_generated_column) {
-				lastColumn = nullable<double>(*raw->last_generated_column);
-			}
-			else if (ptr->computed_column_spans)
-				lastColumn = nullable<double>(std::numeric_limits<double>::infinity());
+		if (idx != RawMappings::npos) {
+			line = nullable<double>(m.generated_line[idx]);
+			column =nullable<double>(m.generated_column[idx]);
+			lastColumn = last_column_or_infinity(idx);
 		}
 		return CHEERP_OBJECT(line, column, lastColumn);
 	}
+	// Batched original_location_for: query i is (lines[i], columns[i]), and
+	// its result is written at index i of the output arrays, with -1 for
+	// missing values. All the arrays must have the same length. Nothing is
+	// allocated on the JS side.
+	//
+	// The outputs are Int32Array for the -1, so they hold values below 2**31
+	// only. Original positions, sources and names are sums of deltas in the
+	// input, so only a map made up to do so has larger ones: those read back
+	// as negative, and 2**32-1 as -1, the same as a missing value.
+	void original_locations_for_batch(
+		client::Uint32Array* lines,
+		client::Uint32Array* columns,
+		Bias bias,
+		client::Int32Array* out_lines,
+		client::Int32Array* out_columns,
+		client::Int32Array* out_sources,
+		client::Int32Array* out_names
+	) {
+		uint32_t n = lines->get_length();
+		check_batch_lengths(n, columns, out_lines, out_columns, out_sources, out_names);
+		LookupBatch& b = lookup_batch(n, false);
+		for (uint32_t i = 0; i < n; i++) {
+			b.lines[i] = (*lines)[i];
+			b.columns[i] = (*columns)[i];
+		}
+		ptr->original_locations_for(b, bias);
+
+		const MappingColumns& m = ptr->by_generated;
+		for (uint32_t i = 0; i < n; i++) {
+			uint32_t idx = b.results[i];
+			int32_t line = -1;
+			int32_t column = -1;
+			int32_t source = -1;
+			int32_t name = -1;
+			if (idx != RawMappings::npos) {
+				line = m.original_line[idx];
+				column = m.original_column[idx];
+				source = m.source[idx];
+				if (m.has_name[idx])
+					name = m.name[idx];
+			}
+			(*out_lines)[i] = line;
+			(*out_columns)[i] = column;
+			(*out_sources)[i] = source;
+			(*out_names)[i] = name;
+		}
+	}
+	// Batched generated_location_for, writing -1 for missing values. The
+	// last column is -1 until column spans are computed, and 2**31-1 for
+	// mappings that extend to the end of the line. All the arrays must have
+	// the same length. Values of 2**31 or more read back as negative, as in
+	// original_locations_for_batch: generated lines never are, as no JS
+	// string is long enough for that many, but columns are sums of deltas.
+	void generated_locations_for_batch(
+		client::Uint32Array* sources,
+		client::Uint32Array* lines,
+		client::Uint32Array* columns,
+		Bias bias,
+		client::Int32Array* out_lines,
+		client::Int32Array* out_columns,
+		client::Int32Array* out_last_columns
+	) {
+		uint32_t n = lines->get_length();
+		check_batch_lengths(n, sources, columns, out_lines, out_columns, out_last_columns);
+		LookupBatch& b = lookup_batch(n, true);
+		for (uint32_t i = 0; i < n; i++) {
+			b.sources[i] = (*sources)[i];
+			b.lines[i] = (*lines)[i];
+			b.columns[i] = (*columns)[i];
+		}
+		ptr->generated_locations_for(b, bias);
+
+		const MappingColumns& m = ptr->by_generated;
+		for (uint32_t i = 0; i < n; i++) {
+			uint32_t idx = b.results[i];
+			int32_t line = -1;
+			int32_t column = -1;
+			int32_t last_column = -1;
+			if (idx != RawMappings::npos) {
+				line = m.generated_line[idx];
+				column = m.generated_column[idx];
+				if (!ptr->computed_column_spans)
+					last_column = -1;
+				else if (m.has_last_generated_column(idx))
+					last_column = m.last_generated_column(idx);
+				else
+					last_column = std::numeric_limits<int32_t>::max();
+			}
+			(*out_lines)[i] = line;
+			(*out_columns)[i] = column;
+			(*out_last_columns)[i] = last_column;
+		}
+	}
 	client::TArray<client::Object>* all_generated_locations_for(
 		uint32_t source,
 		uint32_t original_line,
 		bool has_original_column,
 		uint32_t original_column
 	) {
-		auto& source_buckets = ptr->source_buckets();
+		const OriginalIndex& index = ptr->original_index();
 		// TODO: original code is not doing exactly this
-		if (source >= source_buckets.size())
+		if (source >= index.source_count())
 			return nullptr;
 
-		auto& by_original = source_buckets[source].get();
-		RawMapping m;
-		OriginalLocation o;
-		o.source = source;
-		o.line = original_line;
-		o.column = original_column;
-		m.original = o;
-
-		auto lower = std::lower_bound(
-			by_original.begin(),
-			by_original.end(),
-			m,
-			cmp::Comparator(cmp::Comparator::Mode::ByOriginalLocationLineColumn)
-		);
+		const MappingColumns& m = ptr->by_generated;
+		const uint32_t* end = index.end(source);
+		const uint32_t* lower = index.by_original.data()
+			+ index.lower_bound(
+				m.original_line.data(),
+				m.original_column.data(),
+				source,
+				cmp::OriginalLineColumn::pack(original_line, original_column)
+			);
+		client::TArray<client::Object>* ret = new client::TArray<client::Object>();
+		if (lower == end)
+			return ret;
 		if (!has_original_column)
-			original_line = lower->original->line;
-		original_column = lower->original->column;
+			original_line = m.original_line[*lower];
+		original_column = m.original_column[*lower];
 
-		client::TArray<client::Object>* ret = new client::TArray<client::Object>();
-		for (auto it = lower; it != by_original.end(); ++it) {
-			if (!it->original)
-				return ret;
-			const auto& original = *it->original;
-			if (original.line != original_line) {
+		for (const uint32_t* it = lower; it != end; ++it) {
+			uint32_t idx = *it;
+			if (m.original_line[idx] != original_line) {
 				return ret;
 			}
-			if (has_original_column && original.column != original_column)  {
+			if (has_original_column && m.original_column[idx] != original_column)  {
 				return ret;
 			}
-			double line = it->generated_line;
-			double column = it->generated_column;
-			client::Object* lastColumn = nullptr;
-			if (it->last_generated_column) {
-				lastColumn = nullable<double>(*it->last_generated_column);
-			}
-			else if (ptr->computed_column_spans)
-				lastColumn = nullable<double>(std::numeric_limits<double>::infinity());
+			double line = m.generated_line[idx];
+			double column = m.generated_column[idx];
+			client::Object* lastColumn = last_column_or_infinity(idx);
 			ret->push(CHEERP_OBJECT(line, column, lastColumn));
 		}
 		return ret;
 	}
 	void each_mapping(Order order, client::Object* context, client::MappingCallback* cb) {
-		auto map_to_cb = [this, cb, context](const RawMapping& raw) {
-			client::Object* generatedLine = nullable<double>(raw.generated_line);
-			client::Object* generatedColumn = nullable<double>(raw.generated_column);
+		const MappingColumns& m = ptr->by_generated;
+		auto map_to_cb = [this, &m, cb, context](uint32_t idx) {
+			client::Object* generatedLine = nullable<double>(m.generated_line[idx]);
+			client::Object* generatedColumn = nullable<double>(m.generated_column[idx]);
 			client::Object* lastGeneratedColumn = nullptr;
-			if (raw.last_generated_column) {
-				lastGeneratedColumn = nullable<double>(*raw.last_generated_column);
+			if (ptr->computed_column_spans && m.has_last_generated_column(idx)) {
+				lastGeneratedColumn = nullable<double>(m.last_generated_column(idx));
 			}
 			client::Object* originalLine = nullptr;
 			client::Object* originalColumn = nullptr;
 			client::String* source = nullptr;
 			client::String* name = nullptr;
-			const auto& orig = raw.original;
-			if (orig) {
-				originalLine = nullable<double>(orig->line);
-				originalColumn = nullable<double>(orig->column);
-				if (orig->name)
-					name = names->at(*orig->name);
-				source = sources->at(orig->source);
+			if (m.has_original[idx]) {
+				originalLine = nullable<double>(m.original_line[idx]);
+				originalColumn = nullable<double>(m.original_column[idx]);
+				if (m.has_name[idx])
+					name = names->at(m.name[idx]);
+				source = sources->at(m.source[idx]);
 			}
-			client::Object* m = CHEERP_OBJECT(
+			client::Object* mapping = CHEERP_OBJECT(
 				generatedLine,
 				generatedColumn,
 				lastGeneratedColumn,
@@ -166,34 +349,160 @@ public:
 				source,
 				name
 			);
-			cb->call(context, m);
+			cb->call(context, mapping);
 		};
 		if (order == Order::Generated) {
-			RawMapping* begin = &*ptr->by_generated.begin();
-			RawMapping* end = &*ptr->by_generated.end();
-			for (RawMapping* it = begin; it != end; ++it) {
-				map_to_cb(*it);
+			uint32_t size = m.size();
+			for (uint32_t idx = 0; idx != size; ++idx) {
+				map_to_cb(idx);
 			}
 		} else if (order == Order::Original) {
-			auto& source_buckets = ptr->source_buckets();
-			auto* begin = &*source_buckets.begin();
-			auto* end = &*source_buckets.end();
-			for (auto* bucket = begin; bucket != end; ++bucket) {
-				const auto* bucket_begin = &* bucket->get().begin();
-				const auto* bucket_end = &*bucket->get().end();
-				for (const auto* raw = bucket_begin; raw != bucket_end; ++raw) {
-					map_to_cb(*raw);
-				}
+			const OriginalIndex& index = ptr->original_index();
+			const uint32_t* begin = index.by_original.data();
+			const uint32_t* end = begin + index.by_original.size();
+			for (const uint32_t* idx = begin; idx != end; ++idx) {
+				map_to_cb(*idx);
 			}
 		} else {
 			throw_string("Unknown order of iteration");
 		}
 	}
+	uint32_t size() const {
+		return ptr->by_generated.size();
+	}
+	// What the map holds, the bytes each part of it takes and the
+	// nanoseconds spent in each phase so far, as described by MappingsStats
+	client::Object* stats() {
+		MappingsStats s = ptr->stats();
+		double mappings = s.mappings;
+		double lines = s.lines;
+		double sources = s.sources;
+		double lookups = s.times.lookups;
+		bool computedColumnSpans = s.computed_column_spans;
+		bool hasOriginalIndex = s.has_original_index;
+		bool hasSearchTree = s.has_search_tree;
+
+		double columns = s.columns_bytes;
+		double lineIndex = s.line_index_bytes;
+		double originalIndex = s.original_index_bytes;
+		double searchTree = s.search_tree_bytes;
+		double arena = s.arena_bytes;
+		double arenaUsed = s.arena_used_bytes;
+		double indexArena = s.index_arena_bytes;
+		// Shared by all the maps, freed ones included
+		double pooled = Arena::pooled_bytes();
+		client::Object* bytes = CHEERP_OBJECT(
+			columns,
+			lineIndex,
+			originalIndex,
+			searchTree,
+			arena,
+			arenaUsed,
+			indexArena,
+			pooled
+		);
+
+		double decode = s.times.decode_ns;
+		double sort = s.times.sort_ns;
+		double index = s.times.index_ns;
+		double lookup = s.times.lookup_ns;
+		client::Object* ns = CHEERP_OBJECT(decode, sort, index, lookup);
+
+		return CHEERP_OBJECT(
+			mappings,
+			lines,
+			sources,
+			lookups,
+			computedColumnSpans,
+			hasOriginalIndex,
+			hasSearchTree,
+			bytes,
+			ns
+		);
+	}
+	// Single lookups are not timed by default, as reading the clock costs
+	// about as much as one
+	void time_lookups(bool enable) {
+		ptr->time_lookups(enable);
+	}
+	// Bulk version of each_mapping: writes the mappings from position first
+	// on, in the given order, at index 0 on of the arrays, with -1 for
+	// missing values. The last column is as in generated_locations_for_batch.
+	// Arrays can be null to skip their field, and as many mappings are
+	// written as fit in the shortest of the others. Returns how many were
+	// written, so that a map can be exported in pages of any size by calling
+	// again from first plus that, until it returns 0. In Original order only
+	// the mappings with an original location are exported.
+	uint32_t export_mappings(
+		Order order,
+		uint32_t first,
+		client::Int32Array* generated_lines,
+		client::Int32Array* generated_columns,
+		client::Int32Array* last_generated_columns,
+		client::Int32Array* sources,
+		client::Int32Array* original_lines,
+		client::Int32Array* original_columns,
+		client::Int32Array* names
+	) {
+		const MappingColumns& m = ptr->by_generated;
+		const uint32_t* by_original = nullptr;
+		uint32_t total = m.size();
+		if (order == Order::Original) {
+			const OriginalIndex& index = ptr->original_index();
+			by_original = index.by_original.data();
+			total = index.by_original.size();
+		} else if (order != Order::Generated) {
+			throw_string("Unknown order of iteration");
+		}
+		uint32_t n = first < total ? total - first : 0;
+		for (client::Int32Array* a: {
+			generated_lines,
+			generated_columns,
+			last_generated_columns,
+			sources,
+			original_lines,
+			original_columns,
+			names
+		}) {
+			if (a)
+				n = std::min<uint32_t>(n, a->get_length());
+		}
+
+		for (uint32_t i = 0; i < n; i++) {
+			uint32_t idx = by_original ? by_original[first + i] : first + i;
+			if (generated_lines)
+				(*generated_lines)[i] = m.generated_line[idx];
+			if (generated_columns)
+				(*generated_columns)[i] = m.generated_column[idx];
+			if (last_generated_columns) {
+				int32_t last_column = -1;
+				if (ptr->computed_column_spans) {
+					last_column = m.has_last_generated_column(idx)
+						? int32_t(m.last_generated_column(idx))
+						: std::numeric_limits<int32_t>::max();
+				}
+				(*last_generated_columns)[i] = last_column;
+			}
+			bool original = m.has_original[idx];
+			if (sources)
+				(*sources)[i] = original ? int32_t(m.source[idx]) : -1;
+			if (original_lines)
+				(*original_lines)[i] = original ? int32_t(m.original_line[idx]) : -1;
+			if (original_columns)
+				(*original_columns)[i] = original ? int32_t(m.original_column[idx]) : -1;
+			if (names)
+				(*names)[i] = m.has_name[idx] ? int32_t(m.name[idx]) : -1;
+		}
+		return n;
+	}
 	void destroy() {
+		if (!owned)
+			throw_string("Mappings belongs to a MappingsCache");
 		if (ptr) {
 			delete ptr;
 			ptr = nullptr;
 		}
+		release();
 	}
 #ifdef DEBUG
 	void dump() {
@@ -204,6 +513,51 @@ public:
 	}
 #endif
 private:
+	client::Object* original_location(uint32_t idx) {
+		const MappingColumns& m = ptr->by_generated;
+		client::Object* line = nullptr;
+		client::Object* column = nullptr;
+		client::String* name = nullptr;
+		client::String* source = nullptr;
+		if (idx != RawMappings::npos && m.has_original[idx]) {
+			line = nullable<double>(m.original_line[idx]);
+			column = nullable<double>(m.original_column[idx]);
+			if (m.has_name[idx])
+				name = names->at(m.name[idx]);
+			source = sources->at(m.source[idx]);
+		}
+		return CHEERP_OBJECT(line, column, name, source);
+	}
+	// The last column of a mapping's span, or Infinity when it extends to
+	// the end of the line. Null until column spans have been computed.
+	client::Object* last_column_or_infinity(uint32_t idx) {
+		const MappingColumns& m = ptr->by_generated;
+		if (!ptr->computed_column_spans)
+			return nullptr;
+		if (m.has_last_generated_column(idx))
+			return nullable<double>(m.last_generated_column(idx));
+		return nullable<double>(std::numeric_limits<double>::infinity());
+	}
+	// Frees what is not owned by ptr
+	void release() {
+		if (batch) {
+			delete batch;
+			batch = nullptr;
+		}
+	}
+	template<class... Arrays>
+	static void check_batch_lengths(uint32_t n, Arrays*... arrays) {
+		for (uint32_t length: {static_cast<uint32_t>(arrays->get_length())...}) {
+			if (length != n)
+				throw_string("Arrays of a batch differ in length");
+		}
+	}
+	LookupBatch& lookup_batch(uint32_t n, bool with_sources) {
+		if (!batch)
+			batch = LookupBatch::create();
+		batch->resize(n, with_sources);
+		return *batch;
+	}
 	Mappings(
 		RawMappings* ptr,
 		client::TArray<client::String>* sources,
@@ -211,12 +565,420 @@ private:
 	)	: ptr(ptr)
 		, sources(new ArraySet(sources))
 		, names(new ArraySet(names))
+		, batch(nullptr)
+	{}
+	Mappings(
+		RawMappings* ptr,
+		ArraySet* sources,
+		ArraySet* names
+	)	: ptr(ptr)
+		, sources(sources)
+		, names(names)
+		, batch(nullptr)
 	{}
 	RawMappings* ptr;
 	ArraySet* sources;
 	ArraySet* names;
+	// Reused by the batched lookups
+	LookupBatch* batch;
+	// False for the maps of a MappingsCache, which destroys them
+	bool owned{true};
+
+	friend class MappingsStream;
+	friend class MappingsCursor;
+	friend class MappingsCache;
+	friend class CompressedMappings;
 };
 
+// original_location_for through a LookupCursor. Only valid as long as the
+// Mappings it came from.
+class [[cheerp::jsexport]] [[cheerp::genericjs]] MappingsCursor {
+public:
+	client::Object* original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	) {
+		if (!cursor)
+			throw_string("MappingsCursor has been destroyed");
+		return mappings->original_location(mappings->ptr->original_location_for(
+			*cursor,
+			generated_line,
+			generated_column,
+			bias
+		));
+	}
+	void destroy() {
+		if (cursor) {
+			delete cursor;
+			cursor = nullptr;
+		}
+	}
+private:
+	MappingsCursor(Mappings* mappings)
+		: mappings(mappings)
+		, cursor(LookupCursor::create())
+	{}
+	Mappings* mappings;
+	LookupCursor* cursor;
+
+	friend class Mappings;
+};
+
+MappingsCursor* Mappings::cursor() {
+	return new MappingsCursor(this);
+}
+
+Mappings* MappingsStream::finish(
+	client::TArray<client::String>* sources,
+	client::TArray<client::String>* names
+) {
+	std::pair<RawMappings*, Error> res = parser_or_throw()->finish();
+	destroy();
+	if (res.second == Error::NoError)
+		return new Mappings(res.first, sources, names);
+	else
+		throw_error(res.second);
+}
+
+// Parsed maps kept within a budget of bytes, as described by
+// RawMappingsCache. The Mappings it returns belong to it: they must not be
+// destroyed, and one must not be used after a later put(), trim() or
+// set_budget(), which may have evicted it.
+class [[cheerp::jsexport]] [[cheerp::genericjs]] MappingsCache {
+public:
+	static MappingsCache* create(double budget_bytes, EvictionPolicy policy, bool drop_indexes_first) {
+		return new MappingsCache(new RawMappingsCache(budget_bytes, policy, drop_indexes_first));
+	}
+	// The map cached under key, or null
+	Mappings* get(client::String* key) {
+		if (!ptr_or_throw()->get(std::string(*key)))
+			return nullptr;
+		return cached->get(key);
+	}
+	// The map cached under cache_key, parsed from js_input on a miss, as
+	// {key, mappings}. A null cache_key caches the map by its content, under
+	// the key returned, see RawMappingsCache::put_content().
+	client::Object* put(
+		client::String* cache_key,
+		const client::String* js_input,
+		client::TArray<client::String>* sources,
+		client::TArray<client::String>* names
+	) {
+		RawMappingsCache* c = ptr_or_throw();
+		std::string k;
+		RawMappings* m = nullptr;
+		// A hit on a key of the caller does not copy the input out of JS
+		if (cache_key) {
+			k = std::string(*cache_key);
+			m = c->get(k);
+		}
+		if (!m) {
+			std::string input(*js_input);
+			std::pair<RawMappings*, Error> res = cache_key
+				? RawMappings::create(input)
+				: c->put_content(input.data(), input.size(), k);
+			if (res.second != Error::NoError) {
+				delete res.first;
+				throw_error(res.second);
+			}
+			m = cache_key ? c->insert(k, res.first) : res.first;
+			forget_evicted();
+		}
+		client::String* key = cache_key ? cache_key : new client::String(k.c_str());
+		Mappings* mappings = cached->get(key);
+		if (!mappings) {
+			mappings = new Mappings(m, sources, names);
+			mappings->owned = false;
+			cached->set(key, mappings);
+		}
+		return CHEERP_OBJECT(key, mappings);
+	}
+	bool remove(client::String* key) {
+		if (!ptr_or_throw()->remove(std::string(*key)))
+			return false;
+		forget(key);
+		return true;
+	}
+	// Counts the indexes built since the maps were last used, and evicts
+	// down to the budget
+	void trim() {
+		ptr_or_throw()->trim();
+		forget_evicted();
+	}
+	void set_budget(double bytes) {
+		ptr_or_throw()->set_budget(bytes);
+		forget_evicted();
+	}
+	client::Object* stats() {
+		const RawMappingsCache& c = *ptr_or_throw();
+		double hits = c.counters().hits;
+		double misses = c.counters().misses;
+		double evictions = c.counters().evictions;
+		double indexDrops = c.counters().index_drops;
+		double maps = c.size();
+		double bytes = c.bytes();
+		double budget = c.budget();
+		return CHEERP_OBJECT(hits, misses, evictions, indexDrops, maps, bytes, budget);
+	}
+	void destroy() {
+		if (!ptr)
+			return;
+		for (const std::string& key: ptr->keys())
+			forget(new client::String(key.c_str()));
+		delete ptr;
+		ptr = nullptr;
+	}
+private:
+	MappingsCache(RawMappingsCache* ptr)
+		: ptr(ptr)
+		, cached(new client::TMap<client::String*, Mappings*>())
+	{}
+	RawMappingsCache* ptr_or_throw() {
+		if (!ptr)
+			throw_string("MappingsCache has been destroyed");
+		return ptr;
+	}
+	// Invalidates the Mappings of a map the cache no longer has
+	void forget(client::String* key) {
+		Mappings* m = cached->get(key);
+		if (!m)
+			return;
+		m->ptr = nullptr;
+		m->release();
+		cached->set(key, static_cast<Mappings*>(nullptr));
+	}
+	void forget_evicted() {
+		for (const std::string& key: ptr->take_evicted())
+			forget(new client::String(key.c_str()));
+	}
+	RawMappingsCache* ptr;
+	// The Mappings of each cached map, sharing its RawMappings, or null once
+	// the map is gone
+	client::TMap<client::String*, Mappings*>* cached;
+};
+
+// Mappings that decode a generated line only when a lookup first needs it,
+// for huge maps of which only a few frames are ever symbolicated.
+class [[cheerp::jsexport]] [[cheerp::genericjs]] LazyMappings {
+public:
+	static LazyMappings* create(
+			const client::String* js_input,
+			client::TArray<client::String>* sources,
+			client::TArray<client::String>* names
+		) {
+		std::pair<LazyRawMappings*, Error> res = LazyRawMappings::create(std::string(*js_input));
+		if (res.second == Error::NoError)
+			return new LazyMappings(res.first, sources, names);
+		else
+			throw_error(res.second);
+	}
+	client::Object* original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	) {
+		std::pair<std::optional<RawMapping>, Error> res = ptr->original_location_for(
+			generated_line,
+			generated_column,
+			bias
+		);
+		if (res.second != Error::NoError)
+			throw_error(res.second);
+		client::Object* line = nullptr;
+		client::Object* column = nullptr;
+		client::String* name = nullptr;
+		client::String* source = nullptr;
+		const std::optional<RawMapping>& raw = res.first;
+		if (raw && raw->original) {
+			const auto& orig = raw->original;
+			line = nullable<double>(orig->line);
+			column = nullable<double>(orig->column);
+			if (orig->name)
+				name = names->at(*orig->name);
+			source = sources->at(orig->source);
+		}
+		return CHEERP_OBJECT(line, column, name, source);
+	}
+	uint32_t decoded_line_count() {
+		return ptr->decoded_line_count();
+	}
+	void destroy() {
+		if (ptr) {
+			delete ptr;
+			ptr = nullptr;
+		}
+	}
+private:
+	LazyMappings(
+		LazyRawMappings* ptr,
+		client::TArray<client::String>* sources,
+		client::TArray<client::String>* names
+	)	: ptr(ptr)
+		, sources(new ArraySet(sources))
+		, names(new ArraySet(names))
+	{}
+	LazyRawMappings* ptr;
+	ArraySet* sources;
+	ArraySet* names;
+};
+
+
+// Mappings kept bit packed in blocks, as described by CompressedRawMappings,
+// for maps that are kept around but rarely looked up: several times smaller
+// than Mappings, for lookups that decode a block. Not for small maps, whose
+// size the 13KB of decoded blocks it keeps would dwarf.
+class [[cheerp::jsexport]] [[cheerp::genericjs]] CompressedMappings {
+public:
+	static CompressedMappings* create(
+			const client::String* js_input,
+			client::TArray<client::String>* sources,
+			client::TArray<client::String>* names
+		) {
+		std::string input(*js_input);
+		std::pair<CompressedRawMappings*, Error> res = CompressedRawMappings::create(input.data(), input.size());
+		if (res.second == Error::NoError)
+			return new CompressedMappings(res.first, new ArraySet(sources), new ArraySet(names));
+		else
+			throw_error(res.second);
+	}
+	// A compressed copy of mappings, which can be destroyed afterwards
+	static CompressedMappings* from_mappings(Mappings* mappings) {
+		return new CompressedMappings(
+			CompressedRawMappings::compress(*mappings->ptr),
+			mappings->sources,
+			mappings->names
+		);
+	}
+	client::Object* original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	) {
+		uint32_t idx = ptr->original_location_for(generated_line, generated_column, bias);
+		client::Object* line = nullptr;
+		client::Object* column = nullptr;
+		client::String* name = nullptr;
+		client::String* source = nullptr;
+		if (idx != RawMappings::npos) {
+			RawMapping m = ptr->at(idx);
+			const OriginalLocation& orig = *m.original;
+			line = nullable<double>(orig.line);
+			column = nullable<double>(orig.column);
+			if (orig.name)
+				name = names->at(*orig.name);
+			source = sources->at(orig.source);
+		}
+		return CHEERP_OBJECT(line, column, name, source);
+	}
+	uint32_t size() const {
+		return ptr->size();
+	}
+	double byte_size() const {
+		return ptr->byte_size();
+	}
+	void destroy() {
+		if (ptr) {
+			delete ptr;
+			ptr = nullptr;
+		}
+	}
+private:
+	CompressedMappings(
+		CompressedRawMappings* ptr,
+		ArraySet* sources,
+		ArraySet* names
+	)	: ptr(ptr)
+		, sources(sources)
+		, names(names)
+	{}
+	CompressedRawMappings* ptr;
+	ArraySet* sources;
+	ArraySet* names;
+};
+
+// An index map. Each section is only copied out of its JS string and parsed
+// when a lookup first lands in it, so the cost scales with the sections
+// actually used.
+class [[cheerp::jsexport]] [[cheerp::genericjs]] IndexedMappings {
+public:
+	static IndexedMappings* create() {
+		return new IndexedMappings(IndexedRawMappings::create());
+	}
+	// line and column are the section's offset, 0 based as in the index map
+	void add_section(
+		uint32_t line,
+		uint32_t column,
+		client::String* js_input,
+		client::TArray<client::String>* sources,
+		client::TArray<client::String>* names
+	) {
+		ptr->add_section(line, column);
+		section_inputs->push(js_input);
+		section_sources->push(sources);
+		section_names->push(names);
+	}
+	client::Object* original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	) {
+		uint32_t section = ptr->section_for(generated_line, generated_column);
+		if (section != RawMappings::npos && !ptr->section_parsed(section)) {
+			ptr->parse_section(section, std::string(*(*section_inputs)[section]));
+			(*section_inputs)[section] = nullptr;
+		}
+		std::pair<IndexedRawMappings::Location, Error> res = ptr->original_location_for(
+			generated_line,
+			generated_column,
+			bias
+		);
+		if (res.second != Error::NoError)
+			throw_error(res.second);
+		client::Object* line = nullptr;
+		client::Object* column = nullptr;
+		client::String* name = nullptr;
+		client::String* source = nullptr;
+		const IndexedRawMappings::Location& location = res.first;
+		if (location.index != RawMappings::npos) {
+			const MappingColumns& m = ptr->section_mappings(location.section).first->by_generated;
+			line = nullable<double>(m.original_line[location.index]);
+			column = nullable<double>(m.original_column[location.index]);
+			if (m.has_name[location.index])
+				name = string_at((*section_names)[location.section], m.name[location.index]);
+			source = string_at((*section_sources)[location.section], m.source[location.index]);
+		}
+		return CHEERP_OBJECT(line, column, name, source);
+	}
+	uint32_t parsed_section_count() {
+		return ptr->parsed_section_count();
+	}
+	void destroy() {
+		if (ptr) {
+			delete ptr;
+			ptr = nullptr;
+		}
+	}
+private:
+	IndexedMappings(IndexedRawMappings* ptr)
+		: ptr(ptr)
+		, section_inputs(new client::TArray<client::String>())
+		, section_sources(new client::TArray<client::TArray<client::String>>())
+		, section_names(new client::TArray<client::TArray<client::String>>())
+	{}
+	static client::String* string_at(client::TArray<client::String>* array, uint32_t idx) {
+		if (idx < array->get_length())
+			return (*array)[idx];
+		return nullptr;
+	}
+	IndexedRawMappings* ptr;
+	// The mappings text of each section, in the order they were added, until
+	// it is parsed
+	client::TArray<client::String>* section_inputs;
+	// The sources and names of each section, in the order they were added
+	client::TArray<client::TArray<client::String>>* section_sources;
+	client::TArray<client::TArray<client::String>>* section_names;
+};
 
 #ifdef DEBUG
 [[cheerp::jsexport]]
@@ -236,9 +998,10 @@ extern "C"  void test() {
 	std::string test[] = {"A", "C", "D", "2H", "qxmvrH"};
 
 	for(int i = 0; i < 5; i++) {
-		std::string::const_iterator it = test[i].begin();
-		std::cout<<"test vlq "<<i<<":"<<test[i]<<" -> "<<vlq_decode(it).first<<std::endl;
-		assert(it==test[i].end());
+		const char* it = test[i].data();
+		const char* end = it + test[i].size();
+		std::cout<<"test vlq "<<i<<":"<<test[i]<<" -> "<<vlq_decode(it, end).first<<std::endl;
+		assert(it==end);
 	}
 
 	std::cout<<"------------------------------------------"<<std::endl;
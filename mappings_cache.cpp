@@ -0,0 +1,144 @@
+#include "mappings_cache.h"
+
+#include <algorithm>
+#include <initializer_list>
+
+RawMappingsCache::RawMappingsCache(
+	size_t budget_bytes,
+	EvictionPolicy policy,
+	bool drop_indexes_first
+)	: budget_bytes(budget_bytes)
+	, policy(policy)
+	, drop_indexes_first(drop_indexes_first)
+{}
+
+std::string RawMappingsCache::content_key(const char* input, uint32_t length) {
+	static const char HEX[] = "0123456789abcdef";
+	Hash128 h = hash128(input, length);
+	// The length makes a collision even less likely, at no cost
+	std::string key = std::to_string(length) + ":";
+	for (uint64_t half: {h.high, h.low}) {
+		for (int shift = 60; shift >= 0; shift -= 4)
+			key.push_back(HEX[(half >> shift) & 0xf]);
+	}
+	return key;
+}
+
+RawMappings* RawMappingsCache::get(const std::string& key) {
+	Entries::iterator it = entries.find(key);
+	if (it == entries.end()) {
+		stats.misses++;
+		return nullptr;
+	}
+	stats.hits++;
+	return use(it->second);
+}
+
+std::pair<RawMappings*, Error> RawMappingsCache::put(const std::string& key, const char* input, uint32_t length) {
+	if (RawMappings* m = get(key))
+		return std::make_pair(m, Error::NoError);
+	std::pair<RawMappings*, Error> res = RawMappings::create(input, length);
+	if (res.second != Error::NoError) {
+		delete res.first;
+		return std::make_pair(nullptr, res.second);
+	}
+	return std::make_pair(insert(key, res.first), Error::NoError);
+}
+
+std::pair<RawMappings*, Error> RawMappingsCache::put_content(const char* input, uint32_t length, std::string& key) {
+	key = content_key(input, length);
+	return put(key, input, length);
+}
+
+RawMappings* RawMappingsCache::insert(const std::string& key, RawMappings* m) {
+	Entry& e = entries[key];
+	total_bytes -= e.bytes;
+	e.map.reset(m);
+	e.bytes = 0;
+	e.uses = 0;
+	use(e);
+	trim();
+	return m;
+}
+
+bool RawMappingsCache::remove(const std::string& key) {
+	Entries::iterator it = entries.find(key);
+	if (it == entries.end())
+		return false;
+	total_bytes -= it->second.bytes;
+	entries.erase(it);
+	return true;
+}
+
+std::vector<std::string> RawMappingsCache::keys() const {
+	std::vector<std::string> ret;
+	ret.reserve(entries.size());
+	for (const auto& kv: entries)
+		ret.push_back(kv.first);
+	return ret;
+}
+
+RawMappings* RawMappingsCache::use(Entry& e) {
+	e.last_use = ++clock;
+	e.uses++;
+	// Lookups since the last use may have built indexes
+	recount(e);
+	return e.map.get();
+}
+
+void RawMappingsCache::recount(Entry& e) {
+	total_bytes -= e.bytes;
+	e.bytes = e.map->byte_size();
+	total_bytes += e.bytes;
+}
+
+bool RawMappingsCache::colder(const Entry& e1, const Entry& e2) const {
+	if (policy == EvictionPolicy::LeastFrequentlyUsed && e1.uses != e2.uses)
+		return e1.uses < e2.uses;
+	return e1.last_use < e2.last_use;
+}
+
+void RawMappingsCache::trim() {
+	for (auto& kv: entries)
+		recount(kv.second);
+	if (total_bytes <= budget_bytes)
+		return;
+
+	// Coldest first, without the last map used. There are few enough maps
+	// that sorting them all on each trim costs nothing next to parsing one.
+	std::vector<Entries::iterator> order;
+	order.reserve(entries.size());
+	for (Entries::iterator it = entries.begin(); it != entries.end(); ++it) {
+		if (it->second.last_use != clock)
+			order.push_back(it);
+	}
+	std::sort(order.begin(), order.end(), [this](Entries::iterator it1, Entries::iterator it2) {
+		return colder(it1->second, it2->second);
+	});
+
+	if (drop_indexes_first) {
+		for (Entries::iterator it: order) {
+			if (total_bytes <= budget_bytes)
+				return;
+			Entry& e = it->second;
+			if (!e.map->index_bytes())
+				continue;
+			e.map->drop_indexes();
+			recount(e);
+			stats.index_drops++;
+		}
+	}
+	for (Entries::iterator it: order) {
+		if (total_bytes <= budget_bytes)
+			return;
+		total_bytes -= it->second.bytes;
+		evicted.push_back(it->first);
+		entries.erase(it);
+		stats.evictions++;
+	}
+}
+
+void RawMappingsCache::set_budget(size_t bytes) {
+	budget_bytes = bytes;
+	trim();
+}
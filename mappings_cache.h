@@ -0,0 +1,111 @@
+#ifndef _MAPPINGS_CACHE_H_
+#define _MAPPINGS_CACHE_H_
+
+#include "raw_mappings.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+enum class EvictionPolicy {
+	// The map used the longest time ago goes first
+	LeastRecentlyUsed = 0,
+	// The map used the fewest times goes first, the oldest of them on ties
+	LeastFrequentlyUsed = 1,
+};
+
+struct CacheCounters {
+	uint64_t hits{0};
+	uint64_t misses{0};
+	// Maps thrown away whole
+	uint64_t evictions{0};
+	// Maps whose original index and search trees were thrown away
+	uint64_t index_drops{0};
+};
+
+// Parsed maps for a long-lived process, kept within a budget of bytes. A map
+// is counted for everything it holds in its arenas, RawMappings::byte_size(),
+// so the indexes that lookups build lazily are counted too once the cache
+// sees them again. When over budget the coldest maps first lose their
+// indexes, if drop_indexes_first, which are cheaper to rebuild than the
+// mappings are to parse, and then are evicted.
+//
+// The maps handed out belong to the cache: one is valid until the next call
+// that can evict, i.e. put(), insert(), trim() and set_budget(). Evicted
+// chunks go back to the arena pool, see Arena::set_pool_limit().
+class RawMappingsCache {
+public:
+	RawMappingsCache(
+		size_t budget_bytes,
+		EvictionPolicy policy = EvictionPolicy::LeastRecentlyUsed,
+		bool drop_indexes_first = true
+	);
+	RawMappingsCache(const RawMappingsCache&) = delete;
+	RawMappingsCache& operator=(const RawMappingsCache&) = delete;
+
+	// The map cached under key, or nullptr. Counts a hit or a miss.
+	RawMappings* get(const std::string& key);
+	// The map cached under key, parsing input into it on a miss
+	std::pair<RawMappings*, Error> put(const std::string& key, const char* input, uint32_t length);
+	// The map parsed from input, cached by content rather than by name, and
+	// the key it is cached under: the length of input and its hash128(). Two
+	// inputs only share a map if those collide, which takes one made to.
+	std::pair<RawMappings*, Error> put_content(const char* input, uint32_t length, std::string& key);
+	// Caches m under key, replacing what was there. Takes ownership of m.
+	RawMappings* insert(const std::string& key, RawMappings* m);
+	bool remove(const std::string& key);
+	// Recounts the size of every map, e.g. after lookups built indexes, and
+	// drops indexes and maps until within budget. A map over budget on its
+	// own is kept if it was the last one used.
+	void trim();
+	void set_budget(size_t bytes);
+
+	size_t budget() const {
+		return budget_bytes;
+	}
+	// As of the last call to the cache
+	size_t bytes() const {
+		return total_bytes;
+	}
+	size_t size() const {
+		return entries.size();
+	}
+	const CacheCounters& counters() const {
+		return stats;
+	}
+	std::vector<std::string> keys() const;
+	// The keys evicted since the last call, for callers that keep
+	// something of their own for each map
+	std::vector<std::string> take_evicted() {
+		return std::move(evicted);
+	}
+private:
+	struct Entry {
+		std::unique_ptr<RawMappings> map;
+		size_t bytes{0};
+		uint64_t last_use{0};
+		uint64_t uses{0};
+	};
+	using Entries = std::unordered_map<std::string, Entry>;
+
+	static std::string content_key(const char* input, uint32_t length);
+	RawMappings* use(Entry& e);
+	void recount(Entry& e);
+	bool colder(const Entry& e1, const Entry& e2) const;
+
+	Entries entries;
+	size_t budget_bytes;
+	size_t total_bytes{0};
+	EvictionPolicy policy;
+	bool drop_indexes_first;
+	// Counts the uses, to order them
+	uint64_t clock{0};
+	CacheCounters stats;
+	std::vector<std::string> evicted;
+};
+
+#endif
@@ -0,0 +1,285 @@
+#include "mappings_index.h"
+#include "comparators.h"
+
+#include <cstddef>
+#include <cstring>
+
+#ifndef __CHEERP__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr char MAGIC[8] = {'S', 'M', 'A', 'P', 'I', 'D', 'X', '\0'};
+constexpr uint64_t SECTION_ALIGNMENT = 64;
+
+enum Section {
+	GeneratedLine,
+	GeneratedColumn,
+	Source,
+	OriginalLine,
+	OriginalColumn,
+	Name,
+	HasOriginal,
+	HasName,
+	// Only in version 1 images
+	LastGeneratedColumn,
+	HasLastGeneratedColumn,
+	LineOffsets,
+	SourceOffsets,
+	ByOriginal,
+	SectionCount,
+};
+
+// Where every section of an image is, from the counts in its header
+struct Layout {
+	uint64_t offset[SectionCount];
+	uint64_t size[SectionCount];
+	uint64_t payload_size;
+};
+
+Layout index_layout(const IndexHeader& h) {
+	uint64_t column = uint64_t(h.mapping_count) * sizeof(uint32_t);
+	uint64_t bits = (uint64_t(h.mapping_count) + 63) / 64 * sizeof(uint64_t);
+	bool spans = h.version == 1 && (h.flags & IndexHeader::HasColumnSpans);
+	bool original_index = h.flags & IndexHeader::HasOriginalIndex;
+	Layout l;
+	l.size[GeneratedLine] = column;
+	l.size[GeneratedColumn] = column;
+	l.size[Source] = column;
+	l.size[OriginalLine] = column;
+	l.size[OriginalColumn] = column;
+	l.size[Name] = column;
+	l.size[HasOriginal] = bits;
+	l.size[HasName] = bits;
+	l.size[LastGeneratedColumn] = spans ? column : 0;
+	l.size[HasLastGeneratedColumn] = spans ? bits : 0;
+	l.size[LineOffsets] = uint64_t(h.line_offset_count) * sizeof(uint32_t);
+	l.size[SourceOffsets] = original_index ? (uint64_t(h.source_count) + 1) * sizeof(uint32_t) : 0;
+	l.size[ByOriginal] = original_index ? uint64_t(h.by_original_count) * sizeof(uint32_t) : 0;
+	uint64_t pos = sizeof(IndexHeader);
+	for (uint32_t s = 0; s < SectionCount; s++) {
+		l.offset[s] = pos;
+		pos += (l.size[s] + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+	}
+	l.payload_size = pos - sizeof(IndexHeader);
+	return l;
+}
+
+uint64_t header_checksum(const IndexHeader& h) {
+	return checksum64(reinterpret_cast<const char*>(&h), offsetof(IndexHeader, header_checksum));
+}
+
+}
+
+std::string serialize_index(RawMappings& m, bool with_original_index) {
+	const OriginalIndex* index = with_original_index ? &m.original_index() : nullptr;
+
+	const MappingColumns& c = m.by_generated;
+	IndexHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = IndexHeader::VERSION;
+	h.byte_order = IndexHeader::BYTE_ORDER_MARK;
+	if (m.computed_column_spans)
+		h.flags |= IndexHeader::HasColumnSpans;
+	if (with_original_index)
+		h.flags |= IndexHeader::HasOriginalIndex;
+	h.mapping_count = c.size();
+	h.line_offset_count = m.line_offsets.size();
+	h.source_count = index ? index->source_count() : 0;
+	h.by_original_count = index ? index->by_original.size() : 0;
+
+	Layout l = index_layout(h);
+	h.payload_size = l.payload_size;
+	std::string out(sizeof(IndexHeader) + l.payload_size, '\0');
+	auto put = [&out, &l](Section s, const void* data) {
+		if (l.size[s])
+			std::memcpy(&out[l.offset[s]], data, l.size[s]);
+	};
+	put(GeneratedLine, c.generated_line.data());
+	put(GeneratedColumn, c.generated_column.data());
+	put(Source, c.source.data());
+	put(OriginalLine, c.original_line.data());
+	put(OriginalColumn, c.original_column.data());
+	put(Name, c.name.data());
+	put(HasOriginal, c.has_original.data());
+	put(HasName, c.has_name.data());
+	put(LineOffsets, m.line_offsets.data());
+	if (index) {
+		put(SourceOffsets, index->source_offsets.data());
+		put(ByOriginal, index->by_original.data());
+	}
+
+	h.payload_checksum = checksum64(out.data() + sizeof(IndexHeader), l.payload_size);
+	h.header_checksum = header_checksum(h);
+	std::memcpy(&out[0], &h, sizeof(h));
+	return out;
+}
+
+#ifndef __CHEERP__
+std::pair<MappedMappings*, Error> MappedMappings::open(const char* path, bool verify_checksum) {
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return std::make_pair(nullptr, Error::IndexIoError);
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return std::make_pair(nullptr, Error::IndexIoError);
+	}
+	if (size_t(st.st_size) < sizeof(IndexHeader)) {
+		::close(fd);
+		return std::make_pair(nullptr, Error::IndexInvalidHeader);
+	}
+	void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapping == MAP_FAILED)
+		return std::make_pair(nullptr, Error::IndexIoError);
+
+	std::unique_ptr<MappedMappings> m(new MappedMappings());
+	m->mapping = mapping;
+	m->mapping_size = st.st_size;
+	Error err = m->load(static_cast<const char*>(mapping), st.st_size, verify_checksum);
+	if (err != Error::NoError)
+		return std::make_pair(nullptr, err);
+	return std::make_pair(m.release(), Error::NoError);
+}
+
+std::pair<MappedMappings*, Error> MappedMappings::from_bytes(const char* data, size_t size, bool verify_checksum) {
+	std::unique_ptr<MappedMappings> m(new MappedMappings());
+	Error err = m->load(data, size, verify_checksum);
+	if (err != Error::NoError)
+		return std::make_pair(nullptr, err);
+	return std::make_pair(m.release(), Error::NoError);
+}
+
+MappedMappings::~MappedMappings() {
+	if (mapping)
+		munmap(mapping, mapping_size);
+}
+
+Error MappedMappings::load(const char* data, size_t size, bool verify_checksum) {
+	if (size < sizeof(IndexHeader) || reinterpret_cast<uintptr_t>(data) % alignof(uint64_t) != 0)
+		return Error::IndexInvalidHeader;
+	IndexHeader h;
+	std::memcpy(&h, data, sizeof(h));
+	if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.byte_order != IndexHeader::BYTE_ORDER_MARK)
+		return Error::IndexInvalidHeader;
+	if (h.version != IndexHeader::VERSION && h.version != 1)
+		return Error::IndexUnsupportedVersion;
+	if (h.header_checksum != header_checksum(h))
+		return Error::IndexChecksumMismatch;
+	Layout l = index_layout(h);
+	if (h.payload_size != l.payload_size || size - sizeof(IndexHeader) < l.payload_size)
+		return Error::IndexInvalidHeader;
+	if (verify_checksum && h.payload_checksum != checksum64(data + sizeof(IndexHeader), l.payload_size))
+		return Error::IndexChecksumMismatch;
+
+	auto section = [data, &l](Section s) {
+		return l.size[s] ? data + l.offset[s] : nullptr;
+	};
+	mapping_count = h.mapping_count;
+	generated_line = reinterpret_cast<const uint32_t*>(section(GeneratedLine));
+	generated_column = reinterpret_cast<const uint32_t*>(section(GeneratedColumn));
+	source = reinterpret_cast<const uint32_t*>(section(Source));
+	original_line = reinterpret_cast<const uint32_t*>(section(OriginalLine));
+	original_column = reinterpret_cast<const uint32_t*>(section(OriginalColumn));
+	name = reinterpret_cast<const uint32_t*>(section(Name));
+	has_original = reinterpret_cast<const uint64_t*>(section(HasOriginal));
+	has_name = reinterpret_cast<const uint64_t*>(section(HasName));
+	column_spans = h.flags & IndexHeader::HasColumnSpans;
+	line_offsets = reinterpret_cast<const uint32_t*>(section(LineOffsets));
+	line_offset_count = h.line_offset_count;
+	if (h.flags & IndexHeader::HasOriginalIndex) {
+		source_offsets = reinterpret_cast<const uint32_t*>(data + l.offset[SourceOffsets]);
+		source_count = h.source_count;
+		by_original = reinterpret_cast<const uint32_t*>(section(ByOriginal));
+	}
+	return Error::NoError;
+}
+
+RawMapping MappedMappings::at(uint32_t i) const {
+	RawMapping m;
+	m.generated_line = generated_line[i];
+	m.generated_column = generated_column[i];
+	if (test(has_original, i)) {
+		OriginalLocation o;
+		o.source = source[i];
+		o.line = original_line[i];
+		o.column = original_column[i];
+		if (test(has_name, i))
+			o.name = name[i];
+		m.original = o;
+	}
+	if (column_spans && i + 1 < mapping_count && generated_line[i + 1] == generated_line[i])
+		m.last_generated_column = generated_column[i + 1] - 1;
+	return m;
+}
+
+uint32_t MappedMappings::original_location_for(
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+) const {
+	if (generated_line == 0 || generated_line >= line_offset_count)
+		return RawMappings::npos;
+	uint32_t ret = search_line(
+		this->generated_column,
+		line_offsets[generated_line - 1],
+		line_offsets[generated_line],
+		generated_column,
+		bias
+	);
+	if (ret == RawMappings::npos || !test(has_original, ret))
+		return RawMappings::npos;
+	return ret;
+}
+
+uint32_t MappedMappings::generated_location_for(
+	uint32_t source,
+	uint32_t original_line,
+	uint32_t original_column,
+	Bias bias
+) {
+	if (!source_offsets)
+		build_original_index();
+	if (source >= source_count)
+		return RawMappings::npos;
+
+	uint64_t key = cmp::OriginalLineColumn::pack(original_line, original_column);
+	if (!built_index.samples.empty()) {
+		// Built here rather than read from the image, and has the samples
+		if (bias == Bias::GreatestLowerBound) {
+			uint32_t it = built_index.upper_bound(this->original_line, this->original_column, source, key);
+			return it == source_offsets[source] ? RawMappings::npos : by_original[it - 1];
+		} else {
+			uint32_t it = built_index.lower_bound(this->original_line, this->original_column, source, key);
+			return it == source_offsets[source + 1] ? RawMappings::npos : by_original[it];
+		}
+	}
+	const uint32_t* begin = by_original + source_offsets[source];
+	const uint32_t* end = by_original + source_offsets[source + 1];
+	cmp::ByOriginalLocationLineColumn comparator(this->original_line, this->original_column);
+	if (bias == Bias::GreatestLowerBound) {
+		auto it = std::upper_bound(begin, end, key, comparator);
+		if (it == begin)
+			return RawMappings::npos;
+		return *(it - 1);
+	} else {
+		auto it = std::lower_bound(begin, end, key, comparator);
+		if (it == end)
+			return RawMappings::npos;
+		return *it;
+	}
+}
+
+void MappedMappings::build_original_index() {
+	built_index = OriginalIndex::build(mapping_count, source, original_line, original_column, has_original);
+	source_offsets = built_index.source_offsets.data();
+	source_count = built_index.source_count();
+	by_original = built_index.by_original.data();
+}
+#endif
@@ -0,0 +1,123 @@
+#ifndef _MAPPINGS_INDEX_H_
+#define _MAPPINGS_INDEX_H_
+
+#include "raw_mappings.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A binary image of parsed mappings, so that they can be loaded again without
+// parsing. All the data is stored in the layout the lookups use, so the image
+// can be used in place, e.g. straight from a mmap'd file.
+//
+// The image is a 64 byte IndexHeader followed by the sections below, in this
+// order, each starting at a 64 byte boundary:
+//   generated_line, generated_column, source, original_line, original_column,
+//   name                      uint32[mapping_count]
+//   has_original, has_name    uint64[(mapping_count + 63) / 64] bitmasks
+//   line_offsets              uint32[line_offset_count]
+//   source_offsets            uint32[source_count + 1]   if HasOriginalIndex
+//   by_original               uint32[by_original_count]  if HasOriginalIndex
+// where the mappings of source s in original order are the indices
+// by_original[source_offsets[s]] up to by_original[source_offsets[s+1]].
+// HasColumnSpans only records whether spans are reported, as they follow
+// from the next mapping. Version 1 images, which are still read, stored them
+// in two more sections after has_name.
+// Integers are stored in the byte order of the machine that wrote them.
+struct IndexHeader {
+	static constexpr uint32_t VERSION = 2;
+	static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+	enum Flags: uint32_t {
+		HasColumnSpans = 1,
+		HasOriginalIndex = 2,
+	};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t flags;
+	uint32_t mapping_count;
+	uint32_t line_offset_count;
+	uint32_t source_count;
+	uint32_t by_original_count;
+	uint32_t reserved;
+	// Bytes after the header
+	uint64_t payload_size;
+	uint64_t payload_checksum;
+	// Covers the fields above
+	uint64_t header_checksum;
+};
+static_assert(sizeof(IndexHeader) == 64, "IndexHeader must be 64 bytes");
+
+// Writes the image of m. The per-source original order index is included if
+// with_original_index, otherwise it is rebuilt by the first generated
+// lookup after loading.
+std::string serialize_index(RawMappings& m, bool with_original_index = true);
+
+#ifndef __CHEERP__
+// Mappings answering lookups straight from an image, without copying it
+class MappedMappings {
+public:
+	// Maps the file read-only. Only the header is checked unless
+	// verify_checksum, which reads the whole file; an image that has not
+	// been verified is trusted to be well formed.
+	static std::pair<MappedMappings*, Error> open(const char* path, bool verify_checksum = false);
+	// Uses an image already in memory, which must be 8 byte aligned and
+	// outlive the result
+	static std::pair<MappedMappings*, Error> from_bytes(const char* data, size_t size, bool verify_checksum = false);
+	~MappedMappings();
+
+	uint32_t size() const {
+		return mapping_count;
+	}
+	bool has_column_spans() const {
+		return column_spans;
+	}
+	RawMapping at(uint32_t i) const;
+	// Same as the RawMappings lookups
+	uint32_t original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	) const;
+	uint32_t generated_location_for(
+		uint32_t source,
+		uint32_t original_line,
+		uint32_t original_column,
+		Bias bias
+	);
+private:
+	MappedMappings() = default;
+	Error load(const char* data, size_t size, bool verify_checksum);
+	static bool test(const uint64_t* bits, uint32_t i) {
+		return (bits[i / 64] >> (i % 64)) & 1;
+	}
+	void build_original_index();
+
+	// The mmap'd file, if any
+	void* mapping{nullptr};
+	size_t mapping_size{0};
+
+	uint32_t mapping_count{0};
+	const uint32_t* generated_line{nullptr};
+	const uint32_t* generated_column{nullptr};
+	const uint32_t* source{nullptr};
+	const uint32_t* original_line{nullptr};
+	const uint32_t* original_column{nullptr};
+	const uint32_t* name{nullptr};
+	const uint64_t* has_original{nullptr};
+	const uint64_t* has_name{nullptr};
+	bool column_spans{false};
+	const uint32_t* line_offsets{nullptr};
+	uint32_t line_offset_count{0};
+	const uint32_t* source_offsets{nullptr};
+	uint32_t source_count{0};
+	const uint32_t* by_original{nullptr};
+	// The original order index, when the image does not have one
+	OriginalIndex built_index;
+};
+#endif
+
+#endif
@@ -0,0 +1,311 @@
+#include "raw_mappings.h"
+
+#include <cstring>
+#include <thread>
+
+// The relative fields of a chunk are decoded as if the state was all zeros
+// at its start, which makes the running values offsets from the real state.
+// Once every chunk knows its final offsets, a prefix sum over them gives the
+// state at the start of each chunk, and the offsets are turned into absolute
+// values while the chunks are copied into place.
+//
+// The offsets are stored biased by 2^31 in the uint32 columns, so they order
+// like the absolute values and each line can be sorted by the thread that
+// decoded it. Anything the sequential parser would reject makes the chunk
+// bail out, and the whole input is then parsed again by create() to report
+// the same error.
+
+namespace {
+
+constexpr int64_t OFFSET_BIAS = int64_t(1) << 31;
+
+// Don't bother with threads below this many bytes per chunk
+constexpr uint32_t MIN_CHUNK_SIZE = 256 * 1024;
+
+struct FieldOffset {
+	int64_t value{0};
+	int64_t min{0};
+	int64_t max{0};
+	// Applies a delta, false if the offset can not be stored biased
+	bool add(int64_t delta) {
+		if (delta <= -OFFSET_BIAS || delta >= OFFSET_BIAS)
+			return false;
+		value += delta;
+		if (value <= -OFFSET_BIAS || value >= OFFSET_BIAS)
+			return false;
+		min = std::min(min, value);
+		max = std::max(max, value);
+		return true;
+	}
+	uint32_t biased() const {
+		return value + OFFSET_BIAS;
+	}
+	// Whether start + every value taken stays within what the sequential
+	// parser accepts
+	bool fits(int64_t start) const {
+		return start + min >= 0 && start + max <= UINT32_MAX;
+	}
+};
+
+struct Chunk {
+	const char* begin;
+	const char* end;
+	MappingColumns columns;
+	// The number of mappings before each ';' of the chunk
+	std::vector<uint32_t> line_ends;
+	FieldOffset source;
+	FieldOffset original_line;
+	FieldOffset original_column;
+	FieldOffset name;
+	// The largest source offset of a mapping of the chunk, if any has one
+	bool has_source{false};
+	int64_t max_source{0};
+	bool ok{true};
+	// Time decoding the chunk, and sorting lines of it
+	uint64_t decode_ns{0};
+	uint64_t sort_ns{0};
+	// Where the chunk goes in the result
+	uint32_t first_line{0};
+	uint32_t first_index{0};
+};
+
+void decode_chunk(Chunk& c) {
+	MappingColumns& columns = c.columns;
+	columns.reserve((c.end - c.begin) / 5);
+	LineSorter sorter;
+	uint32_t line_start = 0;
+	bool line_sorted = true;
+	uint32_t generated_column = 0;
+	Segment seg;
+	for (const char* it = c.begin; it != c.end;) {
+		if (*it == ';') {
+			it++;
+			generated_column = 0;
+			if (!line_sorted)
+				sorter.add(columns, line_start, columns.size());
+			line_sorted = true;
+			line_start = columns.size();
+			c.line_ends.push_back(line_start);
+			continue;
+		} else if (*it == ',') {
+			it++;
+			continue;
+		}
+		if (decode_segment(it, c.end, seg) != Error::NoError
+				|| apply_relative(generated_column, seg.fields[0]) != Error::NoError) {
+			c.ok = false;
+			return;
+		}
+		// generated_line is relative to the chunk until it is copied
+		columns.generated_line.push_back(c.line_ends.size());
+		columns.generated_column.push_back(generated_column);
+		if (seg.count > 1) {
+			if (seg.count < 4
+					|| !c.source.add(seg.fields[1])
+					|| !c.original_line.add(seg.fields[2])
+					|| !c.original_column.add(seg.fields[3])
+					|| (seg.count > 4 && !c.name.add(seg.fields[4]))) {
+				c.ok = false;
+				return;
+			}
+			c.max_source = c.has_source ? std::max(c.max_source, c.source.value) : c.source.value;
+			c.has_source = true;
+			columns.has_original.push_back(true);
+			columns.source.push_back(c.source.biased());
+			columns.original_line.push_back(c.original_line.biased());
+			columns.original_column.push_back(c.original_column.biased());
+			columns.has_name.push_back(seg.count > 4);
+			columns.name.push_back(seg.count > 4 ? c.name.biased() : 0);
+		} else {
+			columns.has_original.push_back(false);
+			columns.source.push_back(0);
+			columns.original_line.push_back(0);
+			columns.original_column.push_back(0);
+			columns.has_name.push_back(false);
+			columns.name.push_back(0);
+		}
+		uint32_t i = columns.size() - 1;
+		if (line_sorted && i > line_start)
+			line_sorted = columns.follows(i);
+	}
+	if (!line_sorted)
+		sorter.add(columns, line_start, columns.size());
+	sorter.flush(columns);
+	c.sort_ns = sorter.sort_ns;
+}
+
+// The state at the start of a chunk, as absolute values
+struct ChunkStart {
+	int64_t source{0};
+	int64_t original_line{0};
+	int64_t original_column{0};
+	int64_t name{0};
+};
+
+void copy_chunk(const Chunk& c, const ChunkStart& start, MappingColumns& out) {
+	const MappingColumns& in = c.columns;
+	uint32_t base = c.first_index;
+	// uint32 arithmetic wraps, so adding start - bias undoes the bias
+	uint32_t add_source = start.source - OFFSET_BIAS;
+	uint32_t add_line = start.original_line - OFFSET_BIAS + 1;
+	uint32_t add_column = start.original_column - OFFSET_BIAS;
+	uint32_t add_name = start.name - OFFSET_BIAS;
+	for (uint32_t i = 0; i < in.size(); i++) {
+		out.generated_line[base + i] = c.first_line + in.generated_line[i];
+		out.generated_column[base + i] = in.generated_column[i];
+		if (in.has_original[i]) {
+			out.source[base + i] = in.source[i] + add_source;
+			out.original_line[base + i] = in.original_line[i] + add_line;
+			out.original_column[base + i] = in.original_column[i] + add_column;
+			out.name[base + i] = in.has_name[i] ? in.name[i] + add_name : 0;
+		} else {
+			out.source[base + i] = 0;
+			out.original_line[base + i] = 0;
+			out.original_column[base + i] = 0;
+			out.name[base + i] = 0;
+		}
+	}
+}
+
+// Bits [at, at + 64) of v, as far as v has them, and zeros after
+uint64_t bits_at(const BitVector& v, uint32_t at) {
+	const uint64_t* words = v.data();
+	uint32_t shift = at % 64;
+	uint64_t bits = words[at / 64] >> shift;
+	if (shift && at - shift + 64 < v.size())
+		bits |= words[at / 64 + 1] << (64 - shift);
+	if (v.size() - at < 64)
+		bits &= (uint64_t(1) << (v.size() - at)) - 1;
+	return bits;
+}
+
+// The flags of chunk k go into the words that start within it, reading on
+// into the next chunks for the rest of the last one. Chunks share the words
+// at their edges, so each word is written whole by a single thread.
+void copy_flags(const std::vector<Chunk>& chunks, uint32_t k, uint32_t total, MappingColumns& out) {
+	uint32_t end = k + 1 < chunks.size() ? chunks[k + 1].first_index : total;
+	uint64_t* has_original = out.has_original.data();
+	uint64_t* has_name = out.has_name.data();
+	for (uint32_t w = (chunks[k].first_index + 63) / 64; w < (end + 63) / 64; w++) {
+		uint64_t original_word = 0;
+		uint64_t name_word = 0;
+		uint32_t filled = 0;
+		for (uint32_t j = k; filled < 64 && j < chunks.size();) {
+			const MappingColumns& in = chunks[j].columns;
+			uint32_t at = w * 64 + filled - chunks[j].first_index;
+			if (at >= in.size()) {
+				j++;
+				continue;
+			}
+			original_word |= bits_at(in.has_original, at) << filled;
+			name_word |= bits_at(in.has_name, at) << filled;
+			filled += std::min(64 - filled, in.size() - at);
+		}
+		has_original[w] = original_word;
+		has_name[w] = name_word;
+	}
+}
+
+template<class F>
+void run_on_threads(uint32_t n, F f) {
+	std::vector<std::thread> threads;
+	for (uint32_t k = 1; k < n; k++)
+		threads.emplace_back(f, k);
+	f(0);
+	for (std::thread& t: threads)
+		t.join();
+}
+
+}
+
+std::pair<RawMappings*, Error> RawMappings::create_parallel(const char* input, uint32_t length, uint32_t threads) {
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = std::min(threads, std::max(1u, length / MIN_CHUNK_SIZE));
+	if (threads <= 1)
+		return create(input, length);
+
+	// Split right after a ';' near every 1/threads of the input
+	const char* end = input + length;
+	std::vector<Chunk> chunks;
+	const char* begin = input;
+	for (uint32_t k = 1; k <= threads && begin != end; k++) {
+		const char* split = input + uint64_t(length) * k / threads;
+		if (split < begin)
+			split = begin;
+		const char* semicolon = k == threads ? nullptr
+			: static_cast<const char*>(std::memchr(split, ';', end - split));
+		const char* chunk_end = semicolon ? semicolon + 1 : end;
+		chunks.emplace_back();
+		chunks.back().begin = begin;
+		chunks.back().end = chunk_end;
+		begin = chunk_end;
+	}
+	if (chunks.size() == 1)
+		return create(input, length);
+
+	run_on_threads(chunks.size(), [&](uint32_t k) {
+		uint64_t start = now_ns();
+		decode_chunk(chunks[k]);
+		chunks[k].decode_ns = now_ns() - start - chunks[k].sort_ns;
+	});
+
+	std::vector<ChunkStart> starts(chunks.size());
+	uint32_t lines = 1;
+	uint32_t total = 0;
+	for (uint32_t k = 0; k < chunks.size(); k++) {
+		Chunk& c = chunks[k];
+		ChunkStart& s = starts[k];
+		if (!c.ok
+				|| !c.source.fits(s.source)
+				|| !c.original_line.fits(s.original_line)
+				|| !c.original_column.fits(s.original_column)
+				|| !c.name.fits(s.name))
+			return create(input, length);
+		c.first_line = lines;
+		c.first_index = total;
+		lines += c.line_ends.size();
+		total += c.columns.size();
+		if (k + 1 < chunks.size()) {
+			starts[k + 1].source = s.source + c.source.value;
+			starts[k + 1].original_line = s.original_line + c.original_line.value;
+			starts[k + 1].original_column = s.original_column + c.original_column.value;
+			starts[k + 1].name = s.name + c.name.value;
+		}
+	}
+
+	// Copying the chunks into place counts as decoding
+	uint64_t start = now_ns();
+	std::unique_ptr<RawMappings> mappings(new RawMappings(length));
+	MappingColumns& out = mappings->by_generated;
+	out.generated_line.resize(total);
+	out.generated_column.resize(total);
+	out.source.resize(total);
+	out.original_line.resize(total);
+	out.original_column.resize(total);
+	out.name.resize(total);
+	out.has_original.assign(total, false);
+	out.has_name.assign(total, false);
+	ArenaVector<uint32_t>& line_offsets = mappings->line_offsets;
+	line_offsets.resize(lines + 1);
+	line_offsets[0] = 0;
+	line_offsets[lines] = total;
+	for (uint32_t k = 0; k < chunks.size(); k++) {
+		if (chunks[k].has_source)
+			mappings->source_count = std::max<int64_t>(mappings->source_count, starts[k].source + chunks[k].max_source + 1);
+	}
+	run_on_threads(chunks.size(), [&](uint32_t k) {
+		const Chunk& c = chunks[k];
+		copy_chunk(c, starts[k], out);
+		copy_flags(chunks, k, total, out);
+		for (uint32_t j = 0; j < c.line_ends.size(); j++)
+			line_offsets[c.first_line + j] = c.first_index + c.line_ends[j];
+	});
+	MappingsTimes& times = mappings->times;
+	times.decode_ns = now_ns() - start;
+	for (const Chunk& c: chunks) {
+		times.decode_ns += c.decode_ns;
+		times.sort_ns += c.sort_ns;
+	}
+	return std::make_pair(mappings.release(), Error::NoError);
+}
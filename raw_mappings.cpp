@@ -2,182 +2,1503 @@
 #include "comparators.h"
 
 #include <algorithm>
+#include <cstring>
 #include <memory>
+#include <tuple>
 
-RawMappings::LazyMappings& RawMappings::source_buckets_slow() {
+void MappingColumns::reserve(uint32_t n) {
+	generated_line.reserve(n);
+	generated_column.reserve(n);
+	source.reserve(n);
+	original_line.reserve(n);
+	original_column.reserve(n);
+	name.reserve(n);
+	has_original.reserve(n);
+	has_name.reserve(n);
+}
+
+void MappingColumns::push_back(const RawMapping& m) {
+	generated_line.push_back(m.generated_line);
+	generated_column.push_back(m.generated_column);
+	has_original.push_back(bool(m.original));
+	if (m.original) {
+		source.push_back(m.original->source);
+		original_line.push_back(m.original->line);
+		original_column.push_back(m.original->column);
+		has_name.push_back(bool(m.original->name));
+		name.push_back(m.original->name ? *m.original->name : 0);
+	} else {
+		source.push_back(0);
+		original_line.push_back(0);
+		original_column.push_back(0);
+		has_name.push_back(false);
+		name.push_back(0);
+	}
+}
+
+RawMapping MappingColumns::at(uint32_t i) const {
+	RawMapping m;
+	m.generated_line = generated_line[i];
+	m.generated_column = generated_column[i];
+	if (has_original[i]) {
+		OriginalLocation o;
+		o.source = source[i];
+		o.line = original_line[i];
+		o.column = original_column[i];
+		if (has_name[i])
+			o.name = name[i];
+		m.original = o;
+	}
+	return m;
+}
+
+static void permute_column(
+	ArenaVector<uint32_t>& column,
+	uint32_t begin,
+	const std::vector<uint32_t>& order,
+	std::vector<uint32_t>& scratch
+) {
+	scratch.resize(order.size());
+	for (uint32_t k = 0; k < order.size(); k++)
+		scratch[k] = column[begin + order[k]];
+	std::copy(scratch.begin(), scratch.end(), column.begin() + begin);
+}
+
+static void permute_column(
+	BitVector& column,
+	uint32_t begin,
+	const std::vector<uint32_t>& order,
+	std::vector<uint32_t>& scratch
+) {
+	scratch.resize(order.size());
+	for (uint32_t k = 0; k < order.size(); k++)
+		scratch[k] = column[begin + order[k]];
+	for (uint32_t k = 0; k < order.size(); k++)
+		column.set(begin + k, scratch[k]);
+}
+
+void MappingColumns::permute(uint32_t begin, const std::vector<uint32_t>& order, std::vector<uint32_t>& scratch) {
+	// generated_line is the same for the whole range
+	permute_column(generated_column, begin, order, scratch);
+	permute_column(source, begin, order, scratch);
+	permute_column(original_line, begin, order, scratch);
+	permute_column(original_column, begin, order, scratch);
+	permute_column(name, begin, order, scratch);
+	permute_column(has_original, begin, order, scratch);
+	permute_column(has_name, begin, order, scratch);
+}
+
+RawMapping RawMappings::at(uint32_t i) const {
+	RawMapping m = by_generated.at(i);
+	if (computed_column_spans && by_generated.has_last_generated_column(i))
+		m.last_generated_column = by_generated.last_generated_column(i);
+	return m;
+}
+
+// Room for the columns of as many mappings as MappingsParser reserves for
+// input_length bytes, and the line index of a map with as many lines
+static size_t arena_size_for(uint32_t input_length) {
+	size_t mappings = input_length / 5;
+	// Six columns and two flags per mapping
+	return mappings * 6 * sizeof(uint32_t) + mappings / 4
+		+ input_length / 10 * sizeof(uint32_t);
+}
+
+RawMappings::RawMappings(uint32_t input_length)
+	: arena(std::make_unique<Arena>(arena_size_for(input_length)))
+	, by_generated(arena.get())
+	, line_offsets(arena.get())
+{}
+
+RawMappings::~RawMappings() = default;
+
+void RawMappings::shrink_to_fit() {
+	const MappingColumns& m = by_generated;
+	size_t live = size_t(m.size()) * 6 * sizeof(uint32_t)
+		+ (size_t(m.size()) + 63) / 64 * 2 * sizeof(uint64_t)
+		+ line_offsets.size() * sizeof(uint32_t);
+	if (arena->capacity() <= 2 * live + Arena::CHUNK_GRANULE)
+		return;
+	// The alignment of each vector on top of the data itself
+	auto fresh = std::make_unique<Arena>(live + 8 * alignof(uint64_t));
+	MappingColumns columns(by_generated, fresh.get());
+	ArenaVector<uint32_t> offsets(line_offsets, fresh.get());
+	by_generated = std::move(columns);
+	line_offsets = std::move(offsets);
+	// Only now that nothing is left in it
+	arena = std::move(fresh);
+}
+
+// Stable LSD radix sort of values by keys, a byte at a time, for the
+// key_bits low bits of the keys. The histograms of all the digits are
+// counted in one go, and digits that are the same for every key are skipped.
+template<class Key>
+static void radix_sort(
+	Key* keys,
+	uint32_t* values,
+	uint32_t n,
+	uint32_t key_bits,
+	std::vector<Key>& key_scratch,
+	std::vector<uint32_t>& value_scratch
+) {
+	constexpr uint32_t BUCKETS = 256;
+	constexpr uint32_t MAX_DIGITS = sizeof(Key);
+	const uint32_t digits = (key_bits + 7) / 8;
+	if (n < 2)
+		return;
+	uint32_t counts[MAX_DIGITS][BUCKETS] = {};
+	for (uint32_t i = 0; i < n; i++) {
+		for (uint32_t d = 0; d < digits; d++)
+			counts[d][(keys[i] >> (d * 8)) & (BUCKETS - 1)]++;
+	}
+	if (key_scratch.size() < n) {
+		key_scratch.resize(n);
+		value_scratch.resize(n);
+	}
+	Key* from_keys = keys;
+	uint32_t* from_values = values;
+	Key* to_keys = key_scratch.data();
+	uint32_t* to_values = value_scratch.data();
+	for (uint32_t d = 0; d < digits; d++) {
+		uint32_t* starts = counts[d];
+		uint32_t shift = d * 8;
+		if (starts[(from_keys[0] >> shift) & (BUCKETS - 1)] == n)
+			continue;
+		uint32_t sum = 0;
+		for (uint32_t b = 0; b < BUCKETS; b++) {
+			uint32_t c = starts[b];
+			starts[b] = sum;
+			sum += c;
+		}
+		for (uint32_t i = 0; i < n; i++) {
+			uint32_t pos = starts[(from_keys[i] >> shift) & (BUCKETS - 1)]++;
+			to_keys[pos] = from_keys[i];
+			to_values[pos] = from_values[i];
+		}
+		std::swap(from_keys, to_keys);
+		std::swap(from_values, to_values);
+	}
+	if (from_keys != keys) {
+		std::copy(from_keys, from_keys + n, keys);
+		std::copy(from_values, from_values + n, values);
+	}
+}
+
+// Stable sort of values by keys. The mappings of a source mostly come in
+// original order already, a few places out at most, which an insertion
+// sort puts right in about one move each. Past MAX_MOVES moves per key on
+// average the keys are too shuffled for that, and the rest is radix sorted.
+template<class Key>
+static void sort_bucket(
+	Key* keys,
+	uint32_t* values,
+	uint32_t n,
+	uint32_t key_bits,
+	std::vector<Key>& key_scratch,
+	std::vector<uint32_t>& value_scratch
+) {
+	constexpr uint64_t MAX_MOVES = 8;
+	uint64_t moves_left = n * MAX_MOVES;
+	for (uint32_t i = 1; i < n; i++) {
+		Key key = keys[i];
+		if (!(key < keys[i - 1]))
+			continue;
+		uint32_t value = values[i];
+		uint32_t j = i;
+		do {
+			keys[j] = keys[j - 1];
+			values[j] = values[j - 1];
+			j--;
+		} while (j > 0 && key < keys[j - 1]);
+		keys[j] = key;
+		values[j] = value;
+		if (i - j >= moves_left) {
+			radix_sort(keys, values, n, key_bits, key_scratch, value_scratch);
+			return;
+		}
+		moves_left -= i - j;
+	}
+}
+
+template<class Key>
+static void build_sorted(
+	OriginalIndex& index,
+	uint32_t count,
+	const uint32_t* source,
+	const uint32_t* original_line,
+	const uint32_t* original_column,
+	const uint64_t* has_original,
+	uint32_t column_bits,
+	uint32_t key_bits
+) {
+	auto present = [has_original](uint32_t i) {
+		return (has_original[i / 64] >> (i % 64)) & 1;
+	};
+	const ArenaVector<uint32_t>& offsets = index.source_offsets;
+	uint32_t sources = index.source_count();
+
+	// Bucket by source with the (line, column) keys alongside, so that the
+	// columns are only read in order
+	std::vector<Key> keys(offsets[sources]);
+	index.by_original.resize(offsets[sources]);
+	std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+	for (uint32_t i = 0; i < count; i++) {
+		if (!present(i))
+			continue;
+		uint32_t pos = fill[source[i]]++;
+		keys[pos] = Key(original_line[i]) << column_bits | original_column[i];
+		index.by_original[pos] = i;
+	}
+	fill = std::vector<uint32_t>();
+
+	// Then sort each source on its own, which keeps the passes in cache
+	std::vector<Key> key_scratch;
+	std::vector<uint32_t> index_scratch;
+	for (uint32_t s = 0; s < sources; s++) {
+		sort_bucket(
+			keys.data() + offsets[s],
+			index.by_original.data() + offsets[s],
+			offsets[s + 1] - offsets[s],
+			key_bits,
+			key_scratch,
+			index_scratch
+		);
+	}
+}
+
+OriginalIndex OriginalIndex::build(
+	uint32_t count,
+	const uint32_t* source,
+	const uint32_t* original_line,
+	const uint32_t* original_column,
+	const uint64_t* has_original,
+	Arena* arena
+) {
+	auto present = [has_original](uint32_t i) {
+		return (has_original[i / 64] >> (i % 64)) & 1;
+	};
+	auto bit_width = [](uint32_t v) {
+		uint32_t bits = 0;
+		for (; v; v >>= 1)
+			bits++;
+		return bits;
+	};
+	OriginalIndex index(arena);
+	ArenaVector<uint32_t>& offsets = index.source_offsets;
+	offsets.push_back(0);
+	uint32_t max_line = 0;
+	uint32_t max_column = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (!present(i))
+			continue;
+		if (source[i] + 1 >= offsets.size())
+			offsets.resize(source[i] + 2, 0);
+		offsets[source[i] + 1]++;
+		max_line = std::max(max_line, original_line[i]);
+		max_column = std::max(max_column, original_column[i]);
+	}
+	uint32_t sources = offsets.size() - 1;
+	for (uint32_t s = 0; s < sources; s++)
+		offsets[s + 1] += offsets[s];
+
+	// Keys of as few bits as the lines and columns take, which for most maps
+	// is 32 or less, halving what they take and what the sort moves
+	uint32_t column_bits = bit_width(max_column);
+	uint32_t key_bits = bit_width(max_line) + column_bits;
+	if (key_bits <= 32) {
+		build_sorted<uint32_t>(index, count, source, original_line, original_column,
+			has_original, column_bits, key_bits);
+	} else {
+		build_sorted<uint64_t>(index, count, source, original_line, original_column,
+			has_original, column_bits, key_bits);
+	}
+
+	constexpr uint32_t STRIDE = SAMPLE_STRIDE;
+	const uint32_t* by = index.by_original.data();
+	index.samples.resize((index.by_original.size() + STRIDE - 1) / STRIDE);
+	for (uint32_t k = 0; k < index.samples.size(); k++) {
+		uint32_t i = by[k * STRIDE];
+		index.samples[k] = cmp::OriginalLineColumn::pack(original_line[i], original_column[i]);
+	}
+	return index;
+}
+
+// Like std::partition_point, but probes at doubling distances from first
+// before bisecting, so that it costs O(log d) when the partition point is d
+// elements past first.
+template<class It, class Pred>
+static It gallop_partition_point(It first, It last, Pred pred) {
+	auto n = last - first;
+	decltype(n) lo = 0;
+	decltype(n) hi = 1;
+	while (hi < n && pred(first[hi])) {
+		lo = hi + 1;
+		hi *= 2;
+	}
+	return std::partition_point(first + lo, first + std::min(hi, n), pred);
+}
+
+// The entries among [first, last) of one source that the partition point of
+// below, over their keys, lies among according to the samples: those before
+// are all below, and those after none. Gallops from first if gallop.
+template<class Pred>
+static std::pair<uint32_t, uint32_t> sampled_range(
+	const OriginalIndex& index,
+	uint32_t first,
+	uint32_t last,
+	bool gallop,
+	Pred below
+) {
+	constexpr uint32_t STRIDE = OriginalIndex::SAMPLE_STRIDE;
+	const uint64_t* samples = index.samples.data();
+	// The samples of the entries in [first, last)
+	const uint64_t* begin = samples + (first + STRIDE - 1) / STRIDE;
+	const uint64_t* end = samples + (last + STRIDE - 1) / STRIDE;
+	if (begin >= end)
+		return std::make_pair(first, last);
+	const uint64_t* it = gallop
+		? gallop_partition_point(begin, end, below)
+		: std::partition_point(begin, end, below);
+	uint32_t lo = it == begin ? first : uint32_t(it - 1 - samples) * STRIDE + 1;
+	uint32_t hi = it == end ? last : uint32_t(it - samples) * STRIDE;
+	return std::make_pair(lo, hi);
+}
+
+uint32_t OriginalIndex::lower_bound(
+	const uint32_t* original_line,
+	const uint32_t* original_column,
+	uint32_t source,
+	uint64_t key
+) const {
+	std::pair<uint32_t, uint32_t> range = sampled_range(
+		*this, source_offsets[source], source_offsets[source + 1], false,
+		[key](uint64_t k) {
+			return k < key;
+		}
+	);
+	const uint32_t* by = by_original.data();
+	cmp::ByOriginalLocationLineColumn comparator(original_line, original_column);
+	return std::lower_bound(by + range.first, by + range.second, key, comparator) - by;
+}
+
+uint32_t OriginalIndex::upper_bound(
+	const uint32_t* original_line,
+	const uint32_t* original_column,
+	uint32_t source,
+	uint64_t key
+) const {
+	std::pair<uint32_t, uint32_t> range = sampled_range(
+		*this, source_offsets[source], source_offsets[source + 1], false,
+		[key](uint64_t k) {
+			return k <= key;
+		}
+	);
+	const uint32_t* by = by_original.data();
+	cmp::ByOriginalLocationLineColumn comparator(original_line, original_column);
+	return std::upper_bound(by + range.first, by + range.second, key, comparator) - by;
+}
+
+const OriginalIndex& RawMappings::original_index() {
+	if (original_order) {
+		return *original_order;
+	}
+	return original_index_slow();
+}
+
+const OriginalIndex& RawMappings::original_index_slow() {
+	// The JS API reports spans for the mappings found through the index
 	compute_column_spans();
+	uint64_t start = now_ns();
+	original_order = OriginalIndex::build(
+		by_generated.size(),
+		by_generated.source.data(),
+		by_generated.original_line.data(),
+		by_generated.original_column.data(),
+		by_generated.has_original.data(),
+		indexes_arena()
+	);
+	times.index_ns += now_ns() - start;
+	return *original_order;
+}
 
-	LazyMappings originals;
-	for (const RawMapping& m: by_generated) {
-		if (!m.original)
+Arena* RawMappings::indexes_arena() {
+	// Room for the original index, the largest of the two
+	if (!index_arena) {
+		index_arena = std::make_unique<Arena>(
+			by_generated.size() * (sizeof(uint32_t) + sizeof(uint64_t) / OriginalIndex::SAMPLE_STRIDE)
+		);
+	}
+	return index_arena.get();
+}
+
+void RawMappings::drop_indexes() {
+	original_order.reset();
+	search_tree.reset();
+	index_arena.reset();
+}
+
+std::string encode_mappings(const MappingColumns& mappings, uint32_t line_count) {
+	// A separator and the five fields
+	constexpr uint32_t MAX_SEGMENT_SIZE = 1 + Segment::MAX_FIELDS * VLQ_MAX_DIGITS;
+	uint32_t n = mappings.size();
+	// Real segments average well under 8 bytes; the buffer only grows for
+	// inputs with huge deltas or many empty lines
+	std::string out;
+	out.resize(size_t(n) * 8 + line_count + MAX_SEGMENT_SIZE);
+	char* p = &out[0];
+	char* limit = p + out.size();
+
+	uint32_t line = 1;
+	bool line_start = true;
+	// The previous values, as the decoder tracks them
+	int64_t generated_column = 0;
+	int64_t source = 0;
+	int64_t original_line = 0;
+	int64_t original_column = 0;
+	int64_t name = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t generated_line = mappings.generated_line[i];
+		size_t needed = MAX_SEGMENT_SIZE + (generated_line - line);
+		if (size_t(limit - p) < needed) {
+			size_t used = p - out.data();
+			out.resize(std::max(out.size() * 2, used + needed));
+			p = &out[used];
+			limit = &out[0] + out.size();
+		}
+		for (; line < generated_line; line++) {
+			*p++ = ';';
+			generated_column = 0;
+			line_start = true;
+		}
+		if (!line_start)
+			*p++ = ',';
+		line_start = false;
+
+		p = vlq_encode(int64_t(mappings.generated_column[i]) - generated_column, p);
+		generated_column = mappings.generated_column[i];
+		if (!mappings.has_original[i])
 			continue;
-		if (originals.size() <= m.original->source) {
-			originals.resize(m.original->source+1);
+		// original_line is stored one based, wrapping around like the parser
+		int64_t zero_based_line = uint32_t(mappings.original_line[i] - 1);
+		p = vlq_encode(int64_t(mappings.source[i]) - source, p);
+		p = vlq_encode(zero_based_line - original_line, p);
+		p = vlq_encode(int64_t(mappings.original_column[i]) - original_column, p);
+		source = mappings.source[i];
+		original_line = zero_based_line;
+		original_column = mappings.original_column[i];
+		if (mappings.has_name[i]) {
+			p = vlq_encode(int64_t(mappings.name[i]) - name, p);
+			name = mappings.name[i];
 		}
-		originals[m.original->source].push_back(m);
 	}
-	by_original = std::move(originals);
-	return *by_original;
+	out.resize(p - out.data());
+	if (line < line_count)
+		out.append(line_count - line, ';');
+	return out;
 }
 
-const RawMapping* RawMappings::original_location_for (
+uint32_t search_line(
+	const uint32_t* columns,
+	uint32_t first,
+	uint32_t last,
+	uint32_t generated_column,
+	Bias bias
+) {
+	if (first == last)
+		return RawMappings::npos;
+	const uint32_t* begin = columns + first;
+	const uint32_t* end = columns + last;
+	if (bias == Bias::GreatestLowerBound) {
+		auto it = std::upper_bound(begin, end, generated_column);
+		if (it == begin)
+			return RawMappings::npos;
+		return it - 1 - columns;
+	} else {
+		auto it = std::lower_bound(begin, end, generated_column);
+		if (it == end)
+			return RawMappings::npos;
+		return it - columns;
+	}
+}
+
+uint32_t GeneratedSearchTree::lower_bound(
+	const LineTree& t,
+	const uint32_t* columns,
+	uint32_t first,
+	uint32_t last,
+	uint32_t column
+) const {
+	// Column j of a node whose keys are all less than column sends the
+	// search to child j + 1
+	uint32_t k = 0;
+	for (uint32_t h = 0; h < t.height; h++) {
+		const uint32_t* node = nodes() + (t.level_start[h] + k) * NODE_KEYS;
+		uint32_t i = 0;
+		for (uint32_t j = 0; j < NODE_KEYS; j++)
+			i += node[j] < column;
+		k = k * (NODE_KEYS + 1) + i;
+	}
+	// The answer is in leaf block k, or is the first column of the next
+	const uint32_t* block = columns + first + k * NODE_KEYS;
+	uint32_t size = std::min(NODE_KEYS, last - first - k * NODE_KEYS);
+	uint32_t i = 0;
+	for (uint32_t j = 0; j < size; j++)
+		i += block[j] < column;
+	return first + k * NODE_KEYS + i;
+}
+
+uint32_t GeneratedSearchTree::search_line(
+	const uint32_t* columns,
 	uint32_t generated_line,
+	uint32_t first,
+	uint32_t last,
 	uint32_t generated_column,
 	Bias bias
-){
-	RawMapping m;
-	m.generated_line = generated_line;
-	m.generated_column = generated_column;
-	RawMapping* ret = nullptr;
+) const {
+	const LineTree& t = lines[std::lower_bound(tree_lines.begin(), tree_lines.end(), generated_line) - tree_lines.begin()];
 	if (bias == Bias::GreatestLowerBound) {
-		auto it = std::upper_bound(
-			by_generated.begin(),
-			by_generated.end(),
-			m,
-			cmp::Comparator(cmp::Comparator::Mode::ByGeneratedLocationOnly)
-		);
-		if (it == by_generated.begin())
-			return nullptr;
-		ret = &*(it-1);
+		// The one before the first column past generated_column
+		uint32_t it = generated_column == UINT32_MAX ? last
+			: lower_bound(t, columns, first, last, generated_column + 1);
+		return it == first ? RawMappings::npos : it - 1;
 	} else {
-		auto it = std::lower_bound(
-			by_generated.begin(),
-			by_generated.end(),
-			m,
-			cmp::Comparator(cmp::Comparator::Mode::ByGeneratedLocationOnly)
-		);
-		if (it == by_generated.end())
-			return nullptr;
-		ret = &*it;
+		uint32_t it = lower_bound(t, columns, first, last, generated_column);
+		return it == last ? RawMappings::npos : it;
 	}
-	if (!ret->original || generated_line != ret->generated_line)
-		return nullptr;
+}
+
+GeneratedSearchTree GeneratedSearchTree::build(
+	const MappingColumns& m,
+	const ArenaVector<uint32_t>& line_offsets,
+	Arena* arena
+) {
+	constexpr uint32_t FANOUT = NODE_KEYS + 1;
+	GeneratedSearchTree tree(arena);
+	std::vector<uint32_t> level_size;
+	uint32_t node_count = 0;
+	for (uint32_t l = 1; l < line_offsets.size(); l++) {
+		uint32_t n = line_offsets[l] - line_offsets[l - 1];
+		if (n < MIN_LINE_SIZE)
+			continue;
+		LineTree t;
+		// Count the nodes of each level from the bottom up
+		level_size.clear();
+		uint32_t below = (n + NODE_KEYS - 1) / NODE_KEYS;
+		while (below > 1) {
+			below = (below + FANOUT - 1) / FANOUT;
+			level_size.push_back(below);
+		}
+		t.height = level_size.size();
+		for (uint32_t h = 0; h < t.height; h++) {
+			t.level_start[h] = node_count;
+			node_count += level_size[t.height - 1 - h];
+		}
+		tree.tree_lines.push_back(l);
+		tree.lines.push_back(t);
+	}
+
+	tree.storage.resize(node_count * NODE_KEYS + NODE_KEYS - 1);
+	uintptr_t address = reinterpret_cast<uintptr_t>(tree.storage.data());
+	tree.first_key = (NODE_KEYS - address / sizeof(uint32_t) % NODE_KEYS) % NODE_KEYS;
+	uint32_t* nodes = tree.storage.data() + tree.first_key;
+	for (uint32_t i = 0; i < tree.lines.size(); i++) {
+		const LineTree& t = tree.lines[i];
+		uint32_t first = line_offsets[tree.tree_lines[i] - 1];
+		uint32_t n = line_offsets[tree.tree_lines[i]] - first;
+		uint32_t blocks = (n + NODE_KEYS - 1) / NODE_KEYS;
+		// Fill the levels from the bottom up, span being the number of
+		// leaf blocks under each node of the level below
+		uint64_t span = 1;
+		uint32_t size = blocks;
+		for (uint32_t h = t.height; h-- > 0; ) {
+			size = (size + FANOUT - 1) / FANOUT;
+			for (uint32_t k = 0; k < size; k++) {
+				uint32_t* node = nodes + (t.level_start[h] + k) * NODE_KEYS;
+				for (uint32_t j = 0; j < NODE_KEYS; j++) {
+					uint64_t block = (uint64_t(k) * FANOUT + j + 1) * span;
+					node[j] = block < blocks ? m.generated_column[first + block * NODE_KEYS] : UINT32_MAX;
+				}
+			}
+			span *= FANOUT;
+		}
+	}
+	return tree;
+}
+
+const GeneratedSearchTree& RawMappings::build_search_tree() {
+	if (!search_tree) {
+		uint64_t start = now_ns();
+		search_tree = GeneratedSearchTree::build(by_generated, line_offsets, indexes_arena());
+		times.index_ns += now_ns() - start;
+	}
+	return *search_tree;
+}
+
+MappingsStats RawMappings::stats() const {
+	MappingsStats s;
+	const MappingColumns& m = by_generated;
+	s.mappings = m.size();
+	s.lines = line_offsets.size() - 1;
+	s.sources = source_count;
+	s.columns_bytes = (m.generated_line.capacity()
+			+ m.generated_column.capacity()
+			+ m.source.capacity()
+			+ m.original_line.capacity()
+			+ m.original_column.capacity()
+			+ m.name.capacity()) * sizeof(uint32_t)
+		+ m.has_original.byte_size()
+		+ m.has_name.byte_size();
+	s.line_index_bytes = line_offsets.capacity() * sizeof(uint32_t);
+	s.original_index_bytes = original_order ? original_order->byte_size() : 0;
+	s.search_tree_bytes = search_tree ? search_tree->byte_size() : 0;
+	s.arena_bytes = arena->capacity();
+	s.arena_used_bytes = arena->used();
+	s.index_arena_bytes = index_bytes();
+	s.computed_column_spans = computed_column_spans;
+	s.has_original_index = original_order.has_value();
+	s.has_search_tree = search_tree.has_value();
+	s.times = times;
+	return s;
+}
+
+uint32_t RawMappings::original_location_for (
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+){
+	times.lookups++;
+	if (!timing_lookups)
+		return find_original_location(generated_line, generated_column, bias);
+	uint64_t start = now_ns();
+	uint32_t ret = find_original_location(generated_line, generated_column, bias);
+	times.lookup_ns += now_ns() - start;
 	return ret;
 }
 
-const RawMapping* RawMappings::generated_location_for (
+uint32_t RawMappings::find_original_location(
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+) const {
+	if (generated_line == 0 || generated_line >= line_offsets.size())
+		return npos;
+	// The line index gives the slice of the line directly, so only the
+	// generated_column column is searched.
+	uint32_t first = line_offsets[generated_line - 1];
+	uint32_t last = line_offsets[generated_line];
+	const uint32_t* columns = by_generated.generated_column.data();
+	uint32_t ret = search_tree && last - first >= GeneratedSearchTree::MIN_LINE_SIZE
+		? search_tree->search_line(columns, generated_line, first, last, generated_column, bias)
+		: search_line(columns, first, last, generated_column, bias);
+	if (ret == npos || !by_generated.has_original[ret])
+		return npos;
+	return ret;
+}
+
+uint32_t RawMappings::generated_location_for (
 	uint32_t source,
 	uint32_t original_line,
 	uint32_t original_column,
 	Bias bias
 ) {
-	auto& buckets = source_buckets();
-	// TODO: original code is not doing exactly this
-	if (source >= buckets.size())
-		return nullptr;
+	// The first lookup builds the index, which counts as indexing time
+	const OriginalIndex& index = original_index();
+	times.lookups++;
+	if (!timing_lookups)
+		return find_generated_location(index, source, original_line, original_column, bias);
+	uint64_t start = now_ns();
+	uint32_t ret = find_generated_location(index, source, original_line, original_column, bias);
+	times.lookup_ns += now_ns() - start;
+	return ret;
+}
 
-	auto& by_original = buckets[source].get();
-	RawMapping m;
-	OriginalLocation o;
-	o.source = source;
-	o.line = original_line;
-	o.column = original_column;
-	m.original = o;
+uint32_t RawMappings::find_generated_location(
+	const OriginalIndex& index,
+	uint32_t source,
+	uint32_t original_line,
+	uint32_t original_column,
+	Bias bias
+) const {
+	// TODO: original code is not doing exactly this
+	if (source >= index.source_count())
+		return npos;
 
-	const RawMapping* ret = nullptr;
+	const uint32_t* lines = by_generated.original_line.data();
+	const uint32_t* columns = by_generated.original_column.data();
+	uint64_t key = cmp::OriginalLineColumn::pack(original_line, original_column);
 	if (bias == Bias::GreatestLowerBound) {
-		auto it = std::upper_bound(
-			by_original.begin(),
-			by_original.end(),
-			m,
-			cmp::Comparator(cmp::Comparator::Mode::ByOriginalLocationOnly)
-		);
-		if (it == by_original.begin())
-			return nullptr;
-		ret = &*(it-1);
+		uint32_t it = index.upper_bound(lines, columns, source, key);
+		if (it == index.source_offsets[source])
+			return npos;
+		return index.by_original[it - 1];
 	} else {
-		auto it = std::lower_bound(
-			by_original.begin(),
-			by_original.end(),
-			m,
-			cmp::Comparator(cmp::Comparator::Mode::ByOriginalLocationOnly)
-		);
-		if (it == by_original.end())
-			return nullptr;
-		ret = &*it;
-	}
-	if (ret->original && ret->original->source == source)
-		return ret;
-	return nullptr;
-}
-
-std::pair<RawMappings*, Error> RawMappings::create(const std::string& input) {
-	std::unique_ptr<RawMappings> mappings = std::make_unique<RawMappings>();
-
-	auto in_begin = input.begin();
-	uint32_t in_len = input.size();
-	auto in_end = input.end();
-	uint32_t generated_line = 1;
-	uint32_t generated_column = 0;
-	uint32_t original_line = 0;
-	uint32_t original_column = 0;
-	uint32_t source = 0;
-	uint32_t name = 0;
-	uint32_t generated_line_start_index = 0;
-	Error err = Error::NoError;
-
-	std::vector<RawMapping> by_generated;
-	by_generated.reserve(in_len / 2);
-
-	cmp::Comparator comparator(cmp::Comparator::Mode::ByGeneratedLocationTail);
-	for (auto it = in_begin; it != in_end;) {
-		if (*it ==  ';') {
-			generated_line++;
-			generated_column = 0;
-			it++;
-			if (generated_line_start_index < by_generated.size()) {
-				std::sort(by_generated.begin()+generated_line_start_index,
-				          by_generated.end(),
-				          comparator);
-				generated_line_start_index = by_generated.size();
-			}
+		uint32_t it = index.lower_bound(lines, columns, source, key);
+		if (it == index.source_offsets[source + 1])
+			return npos;
+		return index.by_original[it];
+	}
+}
+
+// The partition point of pred among columns[first, last), found by galloping
+// from hint, first <= hint <= last, in whichever direction it lies
+template<class Pred>
+static uint32_t gallop_from(
+	const uint32_t* columns,
+	uint32_t first,
+	uint32_t last,
+	uint32_t hint,
+	Pred pred
+) {
+	if (hint == first || pred(columns[hint - 1]))
+		return gallop_partition_point(columns + hint, columns + last, pred) - columns;
+	// pred fails from hi on, so step back at doubling distances until it
+	// holds
+	uint32_t hi = hint - 1;
+	uint32_t step = 1;
+	while (hi - first >= step && !pred(columns[hi - step])) {
+		hi -= step;
+		step *= 2;
+	}
+	uint32_t lo = hi - first >= step ? hi - step + 1 : first;
+	return std::partition_point(columns + lo, columns + hi, pred) - columns;
+}
+
+template<class Less>
+static bool queries_sorted(const LookupBatch& batch, Less less) {
+	for (uint32_t q = 1; q < batch.size(); q++) {
+		if (less(q, q - 1))
+			return false;
+	}
+	return true;
+}
+
+void RawMappings::original_locations_for(LookupBatch& batch, Bias bias) {
+	uint64_t start = now_ns();
+	times.lookups += batch.size();
+	const auto& lines = batch.lines;
+	const auto& columns = batch.columns;
+	bool sorted = queries_sorted(batch, [&lines, &columns](uint32_t q1, uint32_t q2) {
+		return std::tie(lines[q1], columns[q1]) < std::tie(lines[q2], columns[q2]);
+	});
+	// Sorting random queries costs more than it saves, so only queries that
+	// come in order get the merged pass
+	if (!sorted) {
+		for (uint32_t q = 0; q < batch.size(); q++)
+			batch.results[q] = find_original_location(lines[q], columns[q], bias);
+		times.lookup_ns += now_ns() - start;
+		return;
+	}
+
+	const auto& generated_columns = by_generated.generated_column;
+	// Everything before cursor is known to be before the current query
+	uint32_t cursor = 0;
+	for (uint32_t q = 0; q < batch.size(); q++) {
+		uint32_t line = lines[q];
+		uint32_t column = columns[q];
+		batch.results[q] = npos;
+		if (line == 0 || line >= line_offsets.size())
 			continue;
-		} else if (*it == ',') {
-			it++;
+		uint32_t line_start = line_offsets[line - 1];
+		uint32_t line_end = line_offsets[line];
+		auto first = generated_columns.begin() + std::max(line_start, cursor);
+		auto last = generated_columns.begin() + line_end;
+		uint32_t ret;
+		if (bias == Bias::GreatestLowerBound) {
+			auto it = gallop_partition_point(first, last, [column](uint32_t c) {
+				return c <= column;
+			});
+			cursor = it - generated_columns.begin();
+			if (cursor == line_start)
+				continue;
+			ret = cursor - 1;
+		} else {
+			auto it = gallop_partition_point(first, last, [column](uint32_t c) {
+				return c < column;
+			});
+			cursor = it - generated_columns.begin();
+			if (cursor == line_end)
+				continue;
+			ret = cursor;
+		}
+		if (by_generated.has_original[ret])
+			batch.results[q] = ret;
+	}
+	times.lookup_ns += now_ns() - start;
+}
+
+void RawMappings::generated_locations_for(LookupBatch& batch, Bias bias) {
+	const OriginalIndex& index = original_index();
+	uint64_t start = now_ns();
+	times.lookups += batch.size();
+	const auto& sources = batch.sources;
+	const auto& lines = batch.lines;
+	const auto& columns = batch.columns;
+	bool sorted = queries_sorted(batch, [&sources, &lines, &columns](uint32_t q1, uint32_t q2) {
+		return std::tie(sources[q1], lines[q1], columns[q1])
+			< std::tie(sources[q2], lines[q2], columns[q2]);
+	});
+	if (!sorted) {
+		for (uint32_t q = 0; q < batch.size(); q++)
+			batch.results[q] = find_generated_location(index, sources[q], lines[q], columns[q], bias);
+		times.lookup_ns += now_ns() - start;
+		return;
+	}
+
+	const uint32_t* by = index.by_original.data();
+	cmp::OriginalLineColumn key_of(&by_generated);
+	uint32_t current_source = npos;
+	// Everything in the current bucket before cursor is known to be before
+	// the current query. The samples are galloped through from there, and
+	// only the stride they leave is searched through the columns.
+	uint32_t cursor = 0;
+	for (uint32_t q = 0; q < batch.size(); q++) {
+		uint32_t source = sources[q];
+		batch.results[q] = npos;
+		if (source >= index.source_count())
 			continue;
+		uint32_t begin = index.source_offsets[source];
+		uint32_t end = index.source_offsets[source + 1];
+		if (source != current_source) {
+			current_source = source;
+			cursor = begin;
 		}
-		RawMapping m;
-		m.generated_line = generated_line;
+		uint64_t key = cmp::OriginalLineColumn::pack(lines[q], columns[q]);
+		if (bias == Bias::GreatestLowerBound) {
+			std::pair<uint32_t, uint32_t> range = sampled_range(index, cursor, end, true, [key](uint64_t k) {
+				return k <= key;
+			});
+			cursor = std::partition_point(by + range.first, by + range.second, [&key_of, key](uint32_t i) {
+				return !key_of.after(i, key);
+			}) - by;
+			if (cursor != begin)
+				batch.results[q] = by[cursor - 1];
+		} else {
+			std::pair<uint32_t, uint32_t> range = sampled_range(index, cursor, end, true, [key](uint64_t k) {
+				return k < key;
+			});
+			cursor = std::partition_point(by + range.first, by + range.second, [&key_of, key](uint32_t i) {
+				return key_of.before(i, key);
+			}) - by;
+			if (cursor != end)
+				batch.results[q] = by[cursor];
+		}
+	}
+	times.lookup_ns += now_ns() - start;
+}
 
-		err = read_relative_vlq(generated_column, it);
-		if (err != Error::NoError) {
-			return std::make_pair(nullptr, err);
+uint32_t RawMappings::original_location_for(
+	LookupCursor& cursor,
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+) {
+	times.lookups++;
+	if (!timing_lookups)
+		return find_original_location(cursor, generated_line, generated_column, bias);
+	uint64_t start = now_ns();
+	uint32_t ret = find_original_location(cursor, generated_line, generated_column, bias);
+	times.lookup_ns += now_ns() - start;
+	return ret;
+}
+
+uint32_t RawMappings::find_original_location(
+	LookupCursor& cursor,
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+) const {
+	if (generated_line == 0 || generated_line >= line_offsets.size())
+		return npos;
+	uint32_t first = line_offsets[generated_line - 1];
+	uint32_t last = line_offsets[generated_line];
+	const uint32_t* columns = by_generated.generated_column.data();
+	uint32_t ret;
+	if (generated_line == cursor.line || generated_line == cursor.line + 1) {
+		uint32_t hint = first;
+		if (generated_line == cursor.line && cursor.position >= first && cursor.position <= last)
+			hint = cursor.position;
+		if (bias == Bias::GreatestLowerBound) {
+			cursor.position = gallop_from(columns, first, last, hint, [generated_column](uint32_t c) {
+				return c <= generated_column;
+			});
+			ret = cursor.position == first ? npos : cursor.position - 1;
+		} else {
+			cursor.position = gallop_from(columns, first, last, hint, [generated_column](uint32_t c) {
+				return c < generated_column;
+			});
+			ret = cursor.position == last ? npos : cursor.position;
 		}
-		m.generated_column = generated_column;
+	} else {
+		ret = search_tree && last - first >= GeneratedSearchTree::MIN_LINE_SIZE
+			? search_tree->search_line(columns, generated_line, first, last, generated_column, bias)
+			: search_line(columns, first, last, generated_column, bias);
+		if (bias == Bias::GreatestLowerBound)
+			cursor.position = ret == npos ? first : ret + 1;
+		else
+			cursor.position = ret == npos ? last : ret;
+	}
+	cursor.line = generated_line;
+	if (ret == npos || !by_generated.has_original[ret])
+		return npos;
+	return ret;
+}
 
-		if (it != in_end && *it != ';' && *it != ',') {
-			OriginalLocation o;
-			err = read_relative_vlq(source, it);
-			if (err != Error::NoError) {
-				return std::make_pair(nullptr, err);
+RawMappings* RawMappings::compose(const RawMappings& outer, uint32_t inner_source, RawMappings& inner) {
+	const MappingColumns& o = outer.by_generated;
+	const MappingColumns& in = inner.by_generated;
+	uint32_t n = o.size();
+
+	// The original locations of outer are generated locations of inner. Sort
+	// them, so that inner is walked once: bucket them by line with a counting
+	// sort, then sort each line by column, which usually it already is.
+	// Other sources, and lines inner does not have, resolve to nothing and
+	// are left out.
+	uint32_t inner_lines = inner.line_offsets.size();
+	auto in_inner = [&o, inner_source, inner_lines](uint32_t i) {
+		return o.has_original[i] && o.source[i] == inner_source
+			&& o.original_line[i] != 0 && o.original_line[i] < inner_lines;
+	};
+	std::vector<uint32_t> line_starts(inner_lines + 1, 0);
+	for (uint32_t i = 0; i < n; i++) {
+		if (in_inner(i))
+			line_starts[o.original_line[i] + 1]++;
+	}
+	for (uint32_t l = 0; l < inner_lines; l++)
+		line_starts[l + 1] += line_starts[l];
+	std::vector<uint32_t> order(line_starts[inner_lines]);
+	std::vector<uint32_t> fill(line_starts.begin(), line_starts.end() - 1);
+	for (uint32_t i = 0; i < n; i++) {
+		if (in_inner(i))
+			order[fill[o.original_line[i]]++] = i;
+	}
+	fill = std::vector<uint32_t>();
+	auto by_column = [&o](uint32_t i1, uint32_t i2) {
+		return o.original_column[i1] < o.original_column[i2];
+	};
+	for (uint32_t l = 1; l < inner_lines; l++) {
+		auto begin = order.begin() + line_starts[l];
+		auto end = order.begin() + line_starts[l + 1];
+		if (!std::is_sorted(begin, end, by_column))
+			std::sort(begin, end, by_column);
+	}
+
+	LookupBatch batch;
+	batch.resize(order.size(), false);
+	for (uint32_t q = 0; q < order.size(); q++) {
+		batch.lines[q] = o.original_line[order[q]];
+		batch.columns[q] = o.original_column[order[q]];
+	}
+	inner.original_locations_for(batch, Bias::GreatestLowerBound);
+	std::vector<uint32_t> resolved(n, npos);
+	for (uint32_t q = 0; q < order.size(); q++)
+		resolved[order[q]] = batch.results[q];
+
+	std::unique_ptr<RawMappings> result(new RawMappings());
+	MappingColumns& r = result->by_generated;
+	SortBuffers buffers;
+	r.reserve(n);
+	result->line_offsets.reserve(outer.line_offsets.size());
+	result->line_offsets.push_back(0);
+	for (uint32_t l = 1; l < outer.line_offsets.size(); l++) {
+		uint32_t line_start = r.size();
+		for (uint32_t i = outer.line_offsets[l - 1]; i < outer.line_offsets[l]; i++) {
+			RawMapping m;
+			m.generated_line = o.generated_line[i];
+			m.generated_column = o.generated_column[i];
+			uint32_t j = resolved[i];
+			if (j != npos) {
+				OriginalLocation loc;
+				loc.source = in.source[j];
+				loc.line = in.original_line[j];
+				loc.column = in.original_column[j];
+				if (in.has_name[j])
+					loc.name = in.name[j];
+				m.original = loc;
+				result->source_count = std::max(result->source_count, loc.source + 1);
 			}
-			o.source = source;
-			err = read_relative_vlq(original_line, it);
-			if (err != Error::NoError) {
-				return std::make_pair(nullptr, err);
+			r.push_back(m);
+		}
+		// Mappings sharing a generated column may now be out of order
+		for (uint32_t k = line_start + 1; k < r.size(); k++) {
+			if (!r.follows(k)) {
+				r.sort_line(line_start, r.size(), buffers);
+				break;
 			}
-			o.line = original_line+1;
-			err = read_relative_vlq(original_column, it);
+		}
+		result->line_offsets.push_back(r.size());
+	}
+	return result.release();
+}
+
+LookupBatch* LookupBatch::create() {
+	return new LookupBatch();
+}
+
+LookupCursor* LookupCursor::create() {
+	return new LookupCursor();
+}
+
+InputBuffer* InputBuffer::create(uint32_t length) {
+	return new InputBuffer(length);
+}
+
+std::pair<RawMappings*, Error> RawMappings::create(const char* input, uint32_t length) {
+	MappingsParser parser(length);
+	Error err = parser.feed(input, length);
+	if (err != Error::NoError)
+		return std::make_pair(nullptr, err);
+	return parser.finish();
+}
+
+MappingsParser* MappingsParser::create() {
+	return new MappingsParser();
+}
+
+MappingsParser::MappingsParser(uint32_t size_hint)
+	: mappings(std::make_unique<RawMappings>(size_hint))
+{
+	// As much as arena_size_for() makes room for, so that neither the line
+	// index nor the columns usually move and leave a copy behind in the arena
+	mappings->line_offsets.reserve(size_hint / 10 + 1);
+	mappings->line_offsets.push_back(0);
+	// Segments are at least 2 bytes long, but real ones are rarely under 5
+	mappings->by_generated.reserve(size_hint / 5);
+}
+
+MappingsParser::~MappingsParser() = default;
+
+static inline bool is_separator(char c) {
+	return c == ';' || c == ',';
+}
+
+Error MappingsParser::feed(const char* chunk, uint32_t length) {
+	if (error != Error::NoError)
+		return error;
+	const char* it = chunk;
+	const char* end = chunk + length;
+	if (!pending.empty()) {
+		// Complete the segment left over from the previous chunk, together
+		// with the separator that ends it
+		const char* sep = std::find_if(it, end, is_separator);
+		if (sep == end) {
+			pending.append(it, end);
+			return Error::NoError;
+		}
+		pending.append(it, sep + 1);
+		error = parse(pending.data(), pending.data() + pending.size());
+		pending.clear();
+		if (error != Error::NoError)
+			return error;
+		it = sep + 1;
+	}
+	// Only segments followed by a separator are known to be complete, the
+	// rest waits for the next chunk
+	const char* last = end;
+	while (last != it && !is_separator(last[-1]))
+		last--;
+	error = parse(it, last);
+	if (error == Error::NoError)
+		pending.assign(last, end);
+	return error;
+}
+
+std::pair<RawMappings*, Error> MappingsParser::finish() {
+	if (error == Error::NoError && !pending.empty()) {
+		error = parse(pending.data(), pending.data() + pending.size());
+		pending.clear();
+	}
+	if (error != Error::NoError)
+		return std::make_pair(nullptr, error);
+	if (generated_line_start_index < mappings->by_generated.size()) {
+		end_line();
+	}
+	uint64_t sort_ns = sorter.sort_ns;
+	sorter.flush(mappings->by_generated);
+	mappings->times.sort_ns += sorter.sort_ns - sort_ns;
+	mappings->line_offsets.push_back(mappings->by_generated.size());
+	mappings->shrink_to_fit();
+	return std::make_pair(mappings.release(), Error::NoError);
+}
+
+Error VlqState::read_mapping(const char*& it, const char* end, RawMapping& m) {
+	Segment seg;
+	Error err = decode_segment(it, end, seg);
+	if (err != Error::NoError) {
+		return err;
+	}
+	m.generated_line = generated_line;
+	err = apply_relative(generated_column, seg.fields[0]);
+	if (err != Error::NoError) {
+		return err;
+	}
+	m.generated_column = generated_column;
+
+	if (seg.count > 1) {
+		if (seg.count < 4) {
+			// A segment must have 1, 4 or 5 fields
+			return it == end ? Error::VlqUnexpectedEof : Error::VlqInvalidBase64;
+		}
+		OriginalLocation o;
+		err = apply_relative(source, seg.fields[1]);
+		if (err != Error::NoError) {
+			return err;
+		}
+		o.source = source;
+		err = apply_relative(original_line, seg.fields[2]);
+		if (err != Error::NoError) {
+			return err;
+		}
+		o.line = original_line+1;
+		err = apply_relative(original_column, seg.fields[3]);
+		if (err != Error::NoError) {
+			return err;
+		}
+		o.column = original_column;
+		if (seg.count > 4) {
+			err = apply_relative(name, seg.fields[4]);
 			if (err != Error::NoError) {
-				return std::make_pair(nullptr, err);
+				return err;
 			}
-			o.column = original_column;
-			if (it != in_end && *it != ';' && *it != ',') {
-				err = read_relative_vlq(name, it);
-				if (err != Error::NoError) {
-					return std::make_pair(nullptr, err);
-				}
-				o.name = name;
+			o.name = name;
+		}
+		m.original = o;
+	}
+	return Error::NoError;
+}
+
+bool MappingColumns::tail_before(uint32_t i1, uint32_t i2) const {
+	cmp::ByGeneratedLocationTail tail(this);
+	return tail(i1, i2);
+}
+
+// Lines up to this long are insertion sorted
+static constexpr uint32_t INSERTION_SORT_MAX = 16;
+
+void MappingColumns::sort_line(uint32_t begin, uint32_t end, SortBuffers& buffers) {
+	uint32_t n = end - begin;
+	// The column in the high half and the position in the line in the low
+	// half, so that the keys are unique and sorting them is stable
+	std::vector<uint64_t>& keys = buffers.keys;
+	keys.resize(n);
+	for (uint32_t k = 0; k < n; k++)
+		keys[k] = uint64_t(generated_column[begin + k]) << 32 | k;
+	if (n <= INSERTION_SORT_MAX) {
+		for (uint32_t k = 1; k < n; k++) {
+			uint64_t key = keys[k];
+			uint32_t j = k;
+			for (; j > 0 && keys[j - 1] > key; j--)
+				keys[j] = keys[j - 1];
+			keys[j] = key;
+		}
+	} else {
+		// LSD radix sort on the column bytes, skipping the bytes that are
+		// the same for the whole line
+		std::vector<uint64_t>& scratch = buffers.keys_scratch;
+		scratch.resize(n);
+		uint64_t* from = keys.data();
+		uint64_t* to = scratch.data();
+		for (uint32_t shift = 32; shift < 64; shift += 8) {
+			uint32_t starts[256] = {};
+			for (uint32_t k = 0; k < n; k++)
+				starts[(from[k] >> shift) & 255]++;
+			if (starts[(from[0] >> shift) & 255] == n)
+				continue;
+			uint32_t sum = 0;
+			for (uint32_t& s: starts) {
+				uint32_t c = s;
+				s = sum;
+				sum += c;
 			}
-			m.original = o;
+			for (uint32_t k = 0; k < n; k++)
+				to[starts[(from[k] >> shift) & 255]++] = from[k];
+			std::swap(from, to);
+		}
+		if (from != keys.data())
+			keys.swap(scratch);
+	}
+	std::vector<uint32_t>& order = buffers.order;
+	order.resize(n);
+	for (uint32_t k = 0; k < n; k++)
+		order[k] = uint32_t(keys[k]);
+	// Mappings sharing a column are still in the order they came in, and
+	// are ordered by the rest of their fields here. Such runs are short.
+	for (uint32_t k = 1; k < n; k++) {
+		if (keys[k] >> 32 != keys[k - 1] >> 32)
+			continue;
+		uint32_t o = order[k];
+		uint32_t j = k;
+		for (; j > 0 && keys[j - 1] >> 32 == keys[k] >> 32
+				&& tail_before(begin + o, begin + order[j - 1]); j--)
+			order[j] = order[j - 1];
+		order[j] = o;
+	}
+	permute(begin, order, buffers.column_scratch);
+}
+
+void LineSorter::add(MappingColumns& columns, uint32_t begin, uint32_t end) {
+	lines.push_back(begin);
+	lines.push_back(end);
+	queued += end - begin;
+	if (queued >= BATCH_MAPPINGS)
+		flush(columns);
+}
+
+void LineSorter::flush(MappingColumns& columns) {
+	if (lines.empty())
+		return;
+	uint64_t start = now_ns();
+	for (uint32_t k = 0; k < lines.size(); k += 2)
+		columns.sort_line(lines[k], lines[k + 1], buffers);
+	sort_ns += now_ns() - start;
+	lines.clear();
+	queued = 0;
+}
+
+void MappingsParser::end_line() {
+	uint32_t end = mappings->by_generated.size();
+	if (!line_sorted)
+		sorter.add(mappings->by_generated, generated_line_start_index, end);
+	line_sorted = true;
+	generated_line_start_index = end;
+}
+
+Error MappingsParser::parse(const char* begin, const char* end) {
+	MappingsTimes& times = mappings->times;
+	uint64_t start = now_ns();
+	uint64_t sort_ns = sorter.sort_ns;
+	Error err = decode(begin, end);
+	times.sort_ns += sorter.sort_ns - sort_ns;
+	times.decode_ns += now_ns() - start - (sorter.sort_ns - sort_ns);
+	return err;
+}
+
+Error MappingsParser::decode(const char* in_begin, const char* in_end) {
+	MappingColumns& by_generated = mappings->by_generated;
+	ArenaVector<uint32_t>& line_offsets = mappings->line_offsets;
+
+	for (const char* it = in_begin; it != in_end;) {
+		if (*it ==  ';') {
+			state.generated_line++;
+			state.generated_column = 0;
+			it++;
+			if (generated_line_start_index < by_generated.size()) {
+				end_line();
+			}
+			line_offsets.push_back(by_generated.size());
+			continue;
+		} else if (*it == ',') {
+			it++;
+			continue;
+		}
+		RawMapping m;
+		Error err = state.read_mapping(it, in_end, m);
+		if (err != Error::NoError) {
+			return err;
 		}
 		by_generated.push_back(m);
+		if (m.original)
+			mappings->source_count = std::max(mappings->source_count, m.original->source + 1);
+		uint32_t i = by_generated.size() - 1;
+		if (line_sorted && i > generated_line_start_index)
+			line_sorted = by_generated.follows(i);
 	}
-	if (generated_line_start_index < by_generated.size()) {
-		std::sort(by_generated.begin()+generated_line_start_index,
-		          by_generated.end(),
-		          comparator);
+	return Error::NoError;
+}
+
+std::pair<LazyRawMappings*, Error> LazyRawMappings::create(std::string input) {
+	std::unique_ptr<LazyRawMappings> mappings(new LazyRawMappings());
+	const char* begin = input.data();
+	const char* end = begin + input.size();
+	// Line l spans [line_starts[l-1], line_starts[l]-1), the last line's
+	// end gets a virtual ';' after the input
+	mappings->line_starts.push_back(0);
+	for (const char* it = begin; (it = static_cast<const char*>(std::memchr(it, ';', end - it))); it++) {
+		mappings->line_starts.push_back(it + 1 - begin);
 	}
-	mappings->by_generated = std::move(by_generated);
+	mappings->line_starts.push_back(input.size() + 1);
+	mappings->lines.resize(mappings->line_count());
+	mappings->checkpoints.push_back(VlqState());
+	mappings->input = std::move(input);
 	return std::make_pair(mappings.release(), Error::NoError);
 }
+
+Error LazyRawMappings::skip_line(uint32_t generated_line, VlqState& state) const {
+	const char* it = input.data() + line_starts[generated_line - 1];
+	const char* end = input.data() + line_starts[generated_line] - 1;
+	state.generated_line = generated_line;
+	state.generated_column = 0;
+	RawMapping m;
+	while (it != end) {
+		if (*it == ',') {
+			it++;
+			continue;
+		}
+		Error err = state.read_mapping(it, input_end(), m);
+		if (err != Error::NoError)
+			return err;
+	}
+	return Error::NoError;
+}
+
+Error LazyRawMappings::state_at(uint32_t generated_line, VlqState& state) {
+	uint32_t k = (generated_line - 1) / CHECKPOINT_INTERVAL;
+	// Extend the checkpoints up to the one just before the line
+	while (checkpoints.size() <= k) {
+		state = checkpoints.back();
+		uint32_t first = (checkpoints.size() - 1) * CHECKPOINT_INTERVAL + 1;
+		for (uint32_t l = first; l < first + CHECKPOINT_INTERVAL; l++) {
+			Error err = skip_line(l, state);
+			if (err != Error::NoError)
+				return err;
+		}
+		checkpoints.push_back(state);
+	}
+	state = checkpoints[k];
+	for (uint32_t l = k * CHECKPOINT_INTERVAL + 1; l < generated_line; l++) {
+		Error err = skip_line(l, state);
+		if (err != Error::NoError)
+			return err;
+	}
+	return Error::NoError;
+}
+
+std::pair<const MappingColumns*, Error> LazyRawMappings::decoded_line(uint32_t generated_line) {
+	if (generated_line == 0 || generated_line > line_count())
+		return std::make_pair(nullptr, Error::NoError);
+	std::unique_ptr<MappingColumns>& cached = lines[generated_line - 1];
+	if (cached)
+		return std::make_pair(cached.get(), Error::NoError);
+
+	VlqState state;
+	Error err = state_at(generated_line, state);
+	if (err != Error::NoError)
+		return std::make_pair(nullptr, err);
+
+	const char* it = input.data() + line_starts[generated_line - 1];
+	const char* end = input.data() + line_starts[generated_line] - 1;
+	state.generated_line = generated_line;
+	state.generated_column = 0;
+	auto line = std::make_unique<MappingColumns>();
+	bool sorted = true;
+	while (it != end) {
+		if (*it == ',') {
+			it++;
+			continue;
+		}
+		RawMapping m;
+		err = state.read_mapping(it, input_end(), m);
+		if (err != Error::NoError)
+			return std::make_pair(nullptr, err);
+		line->push_back(m);
+		if (sorted && line->size() > 1)
+			sorted = line->follows(line->size() - 1);
+	}
+	if (!sorted) {
+		line->sort_line(0, line->size(), sort_buffers);
+	}
+	cached = std::move(line);
+	decoded_lines++;
+	return std::make_pair(cached.get(), Error::NoError);
+}
+
+std::pair<std::optional<RawMapping>, Error> LazyRawMappings::original_location_for(
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+) {
+	const MappingColumns* line;
+	Error err;
+	std::tie(line, err) = decoded_line(generated_line);
+	if (!line)
+		return std::make_pair(std::nullopt, err);
+	uint32_t idx = search_line(line->generated_column.data(), 0, line->size(), generated_column, bias);
+	if (idx == RawMappings::npos || !line->has_original[idx])
+		return std::make_pair(std::nullopt, Error::NoError);
+	return std::make_pair(line->at(idx), Error::NoError);
+}
+
+static bool offset_before(const IndexedRawMappings::Offset& o1, const IndexedRawMappings::Offset& o2) {
+	return std::tie(o1.line, o1.column) < std::tie(o2.line, o2.column);
+}
+
+IndexedRawMappings* IndexedRawMappings::create() {
+	return new IndexedRawMappings();
+}
+
+void IndexedRawMappings::add_section(uint32_t line, uint32_t column, std::string input) {
+	add_section(line, column);
+	sections.back().input = std::move(input);
+}
+
+void IndexedRawMappings::add_section(uint32_t line, uint32_t column) {
+	Offset offset{line, column, uint32_t(sections.size())};
+	auto it = std::upper_bound(offsets.begin(), offsets.end(), offset, offset_before);
+	offsets.insert(it, offset);
+	sections.emplace_back();
+	sections.back().line = line;
+	sections.back().column = column;
+}
+
+uint32_t IndexedRawMappings::section_for(uint32_t generated_line, uint32_t generated_column) const {
+	if (generated_line == 0)
+		return RawMappings::npos;
+	Offset location{generated_line - 1, generated_column, 0};
+	auto it = std::upper_bound(offsets.begin(), offsets.end(), location, offset_before);
+	if (it == offsets.begin())
+		return RawMappings::npos;
+	return (it - 1)->section;
+}
+
+Error IndexedRawMappings::parse_section(uint32_t section, const std::string& input) {
+	Section& s = sections[section];
+	if (!section_parsed(section)) {
+		std::pair<RawMappings*, Error> res = RawMappings::create(input);
+		s.mappings.reset(res.first);
+		s.error = res.second;
+		std::string().swap(s.input);
+		parsed_sections++;
+	}
+	return s.error;
+}
+
+std::pair<RawMappings*, Error> IndexedRawMappings::section_mappings(uint32_t section) {
+	Section& s = sections[section];
+	parse_section(section, s.input);
+	return std::make_pair(s.mappings.get(), s.error);
+}
+
+RawMapping IndexedRawMappings::at(const Location& location) {
+	const Section& s = sections[location.section];
+	RawMapping m = s.mappings->at(location.index);
+	// Only the first line of a section is shifted right
+	if (m.generated_line == 1) {
+		m.generated_column += s.column;
+		if (m.last_generated_column)
+			*m.last_generated_column += s.column;
+	}
+	m.generated_line += s.line;
+	return m;
+}
+
+std::pair<IndexedRawMappings::Location, Error> IndexedRawMappings::original_location_for(
+	uint32_t generated_line,
+	uint32_t generated_column,
+	Bias bias
+) {
+	Location location;
+	uint32_t section = section_for(generated_line, generated_column);
+	if (section == RawMappings::npos)
+		return std::make_pair(location, Error::NoError);
+	std::pair<RawMappings*, Error> res = section_mappings(section);
+	if (res.second != Error::NoError)
+		return std::make_pair(location, res.second);
+	const Section& s = sections[section];
+	uint32_t line = generated_line - s.line;
+	uint32_t column = line == 1 ? generated_column - s.column : generated_column;
+	uint32_t index = res.first->original_location_for(line, column, bias);
+	if (index != RawMappings::npos) {
+		location.section = section;
+		location.index = index;
+	}
+	return std::make_pair(location, Error::NoError);
+}
@@ -1,34 +1,36 @@
 #ifndef _RAW_MAPPINGS_H_
 #define _RAW_MAPPINGS_H_
 
+#include "arena.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <string>
 #include <vector>
 #include <optional>
+#include <memory>
 
 enum class Bias {
 	GreatestLowerBound = 1,
 	LeastUpperBound = 2,
 };
 
-template<class T, class C>
-class LazilySorted {
+// Raw input bytes owned by the linear heap. The JS side writes the mappings
+// straight into it, so that they can be parsed in place without copying.
+class InputBuffer {
 public:
-	LazilySorted(): sorted(false) {}
-	const std::vector<T>& get() {
-		if(sorted)
-			return vec;
-		std::sort(vec.begin(), vec.end(), C());
-		sorted = true;
-		return vec;
-	}
-	void push_back(T elem) {
-		sorted = false;
-		vec.push_back(elem);
+	static InputBuffer* create(uint32_t length);
+	char* data() {
+		return bytes.get();
+	}
+	uint32_t size() const {
+		return length;
 	}
 private:
-	bool sorted;
-	std::vector<T> vec;
+	InputBuffer(uint32_t length): bytes(new char[length]), length(length) {}
+	std::unique_ptr<char[]> bytes;
+	uint32_t length;
 };
 
 struct OriginalLocation {
@@ -66,61 +68,683 @@ struct RawMapping {
 	}
 #endif
 };
-namespace cmp {
-	class Comparator;
-}
+// A packed vector of flags, one bit each
+class BitVector {
+public:
+	explicit BitVector(Arena* arena = nullptr): words(arena) {}
+	BitVector(const BitVector& v, Arena* arena): words(v.words, arena), length(v.length) {}
+	uint32_t size() const {
+		return length;
+	}
+	bool empty() const {
+		return length == 0;
+	}
+	bool operator[](uint32_t i) const {
+		return (words[i / 64] >> (i % 64)) & 1;
+	}
+	void set(uint32_t i, bool v) {
+		uint64_t bit = uint64_t(1) << (i % 64);
+		if (v)
+			words[i / 64] |= bit;
+		else
+			words[i / 64] &= ~bit;
+	}
+	void push_back(bool v) {
+		if (length % 64 == 0)
+			words.push_back(0);
+		words.back() |= uint64_t(v) << (length % 64);
+		length++;
+	}
+	void assign(uint32_t n, bool v) {
+		words.assign((n + 63) / 64, v ? ~uint64_t(0) : 0);
+		length = n;
+	}
+	void reserve(uint32_t n) {
+		words.reserve((n + 63) / 64);
+	}
+	size_t byte_size() const {
+		return words.capacity() * sizeof(uint64_t);
+	}
+	// The bits packed in 64 bit words, bit i of the vector being bit i % 64
+	// of word i / 64
+	const uint64_t* data() const {
+		return words.data();
+	}
+	uint64_t* data() {
+		return words.data();
+	}
+private:
+	ArenaVector<uint64_t> words;
+	uint32_t length{0};
+};
+
+// Scratch space for MappingColumns::sort_line. Parsers keep theirs across
+// lines, so that sorting a line allocates nothing once the buffers have
+// grown to the longest line.
+struct SortBuffers {
+	std::vector<uint64_t> keys;
+	std::vector<uint64_t> keys_scratch;
+	std::vector<uint32_t> order;
+	std::vector<uint32_t> column_scratch;
+};
+
+// All the mappings, stored as parallel columns indexed by the position of the
+// mapping in generated order. Absent fields are stored as 0 and flagged in the
+// has_* bitmasks. Column spans are not stored, as they follow from the next
+// mapping.
+struct MappingColumns {
+	ArenaVector<uint32_t> generated_line;
+	ArenaVector<uint32_t> generated_column;
+	ArenaVector<uint32_t> source;
+	ArenaVector<uint32_t> original_line;
+	ArenaVector<uint32_t> original_column;
+	ArenaVector<uint32_t> name;
+	BitVector has_original;
+	BitVector has_name;
+
+	// Allocates the columns from arena, or from the heap if there is none
+	explicit MappingColumns(Arena* arena = nullptr)
+		: generated_line(arena)
+		, generated_column(arena)
+		, source(arena)
+		, original_line(arena)
+		, original_column(arena)
+		, name(arena)
+		, has_original(arena)
+		, has_name(arena)
+	{}
+	// A copy of m allocated from arena, without spare capacity
+	MappingColumns(const MappingColumns& m, Arena* arena)
+		: generated_line(m.generated_line, arena)
+		, generated_column(m.generated_column, arena)
+		, source(m.source, arena)
+		, original_line(m.original_line, arena)
+		, original_column(m.original_column, arena)
+		, name(m.name, arena)
+		, has_original(m.has_original, arena)
+		, has_name(m.has_name, arena)
+	{}
+
+	uint32_t size() const {
+		return generated_line.size();
+	}
+	bool empty() const {
+		return generated_line.empty();
+	}
+	void reserve(uint32_t n);
+	void push_back(const RawMapping& m);
+	// Without last_generated_column, see RawMappings::at()
+	RawMapping at(uint32_t i) const;
+	// A mapping spans up to the column before the next mapping on its line,
+	// or to the end of the line if it is the last one there
+	bool has_last_generated_column(uint32_t i) const {
+		return i + 1 < size() && generated_line[i + 1] == generated_line[i];
+	}
+	// Only for a mapping that has_last_generated_column
+	uint32_t last_generated_column(uint32_t i) const {
+		return generated_column[i + 1] - 1;
+	}
+	// Reorders the mappings in [begin, begin+order.size()), which must all
+	// be on the same generated line, so that the mapping at begin+order[k]
+	// ends up at begin+k. scratch is scratch space.
+	void permute(uint32_t begin, const std::vector<uint32_t>& order, std::vector<uint32_t>& scratch);
+	// Whether mapping i is in order after mapping i-1 of the same line
+	bool follows(uint32_t i) const {
+		if (generated_column[i] != generated_column[i - 1])
+			return generated_column[i] > generated_column[i - 1];
+		return !tail_before(i, i - 1);
+	}
+	// Sorts the mappings in [begin, end), which must all be on the same
+	// generated line, by column and then by the rest of their fields
+	void sort_line(uint32_t begin, uint32_t end, SortBuffers& buffers);
+private:
+	// cmp::ByGeneratedLocationTail, which needs the complete type
+	bool tail_before(uint32_t i1, uint32_t i2) const;
+};
+
+// The lines a parser found out of order, sorted a batch at a time so that
+// the clock is read once per batch rather than around every line, while the
+// lines of the batch are still in cache
+class LineSorter {
+public:
+	// Mappings queued before a batch is sorted
+	static constexpr uint32_t BATCH_MAPPINGS = 4096;
+	// Queues the line [begin, end) of columns, and sorts the batch once it
+	// holds BATCH_MAPPINGS mappings
+	void add(MappingColumns& columns, uint32_t begin, uint32_t end);
+	// Sorts the lines queued so far
+	void flush(MappingColumns& columns);
+	uint64_t sort_ns{0};
+private:
+	// The begin and end of every queued line
+	std::vector<uint32_t> lines;
+	uint32_t queued{0};
+	SortBuffers buffers;
+};
+
+// Writes mappings sorted by generated location back to the ';' and ','
+// separated VLQ text. Empty lines are added at the end to make line_count
+// lines, if there are fewer.
+std::string encode_mappings(const MappingColumns& mappings, uint32_t line_count = 0);
+
+// Query and result columns for the batched lookups. Lives in the linear heap
+// and is reused across batches; the query columns a lookup does not need
+// are left empty.
+struct LookupBatch {
+	static LookupBatch* create();
+	std::vector<uint32_t> sources;
+	std::vector<uint32_t> lines;
+	std::vector<uint32_t> columns;
+	// The index in by_generated answering each query, or RawMappings::npos
+	std::vector<uint32_t> results;
+	uint32_t size() const {
+		return results.size();
+	}
+	void resize(uint32_t n, bool with_sources) {
+		sources.resize(with_sources ? n : 0);
+		lines.resize(n);
+		columns.resize(n);
+		results.resize(n);
+	}
+};
+
+// Where the last lookup through it ended, so that the next one can search
+// from there. Lives in the linear heap like LookupBatch, and can be used
+// with any map: a position that is not on the queried line is ignored.
+struct LookupCursor {
+	static LookupCursor* create();
+	// The generated line of the last lookup, 0 before the first one
+	uint32_t line{0};
+	// The index in by_generated of the first mapping that lookup found to
+	// be past its column (or, with LeastUpperBound, not before it)
+	uint32_t position{0};
+};
+
+// Finds the mapping for a generated column among columns[first, last), which
+// all belong to the same line. Returns RawMappings::npos if there is none.
+uint32_t search_line(
+	const uint32_t* columns,
+	uint32_t first,
+	uint32_t last,
+	uint32_t generated_column,
+	Bias bias
+);
+
+// The mappings that have an original location, sorted by source, then by
+// original line and column, then by generated position. The mappings of
+// source s are by_original[source_offsets[s]] up to
+// by_original[source_offsets[s+1]].
+struct OriginalIndex {
+	// One key is sampled per this many entries of by_original
+	static constexpr uint32_t SAMPLE_STRIDE = 16;
+
+	ArenaVector<uint32_t> source_offsets;
+	ArenaVector<uint32_t> by_original;
+	// The (original_line, original_column) of by_original[k * SAMPLE_STRIDE],
+	// packed as by cmp::OriginalLineColumn. A search goes through these,
+	// which are contiguous, down to SAMPLE_STRIDE entries, and only reads
+	// the columns of those, for 0.5 bytes per mapping.
+	ArenaVector<uint64_t> samples;
+
+	explicit OriginalIndex(Arena* arena = nullptr)
+		: source_offsets(arena)
+		, by_original(arena)
+		, samples(arena)
+	{}
+
+	uint32_t source_count() const {
+		return source_offsets.empty() ? 0 : source_offsets.size() - 1;
+	}
+	size_t byte_size() const {
+		return (source_offsets.capacity() + by_original.capacity()) * sizeof(uint32_t)
+			+ samples.capacity() * sizeof(uint64_t);
+	}
+	const uint32_t* begin(uint32_t source) const {
+		return by_original.data() + source_offsets[source];
+	}
+	const uint32_t* end(uint32_t source) const {
+		return by_original.data() + source_offsets[source + 1];
+	}
+	// The first entry of source whose key is not less than key, or greater
+	// than key, as the position in by_original. The columns are those the
+	// index was built from.
+	uint32_t lower_bound(
+		const uint32_t* original_line,
+		const uint32_t* original_column,
+		uint32_t source,
+		uint64_t key
+	) const;
+	uint32_t upper_bound(
+		const uint32_t* original_line,
+		const uint32_t* original_column,
+		uint32_t source,
+		uint64_t key
+	) const;
+	// Buckets the indices by source with a counting sort, then sorts each
+	// bucket by line and column, packed into 32 bit keys when they fit. The
+	// sort is stable, so ties stay in generated order. has_original is a
+	// bitmask as in BitVector.
+	static OriginalIndex build(
+		uint32_t count,
+		const uint32_t* source,
+		const uint32_t* original_line,
+		const uint32_t* original_column,
+		const uint64_t* has_original,
+		Arena* arena = nullptr
+	);
+};
+
+// Static B+ trees over the generated columns of the long lines. The leaves
+// are the columns themselves, in blocks of NODE_KEYS, and each level above
+// has one node of NODE_KEYS keys per NODE_KEYS + 1 nodes below, key j being
+// the first column under child j + 1. Nodes are one cache line each, so a
+// lookup reads about one line per level, 5 or 6 of them for millions of
+// mappings, where a binary search over the line misses the cache on most of
+// its ~23 probes. Short lines only span a few cache lines and are left to
+// search_line().
+class GeneratedSearchTree {
+public:
+	static constexpr uint32_t NODE_KEYS = 16;
+	static constexpr uint32_t MIN_LINE_SIZE = 4096;
+
+	static GeneratedSearchTree build(
+		const MappingColumns& m,
+		const ArenaVector<uint32_t>& line_offsets,
+		Arena* arena = nullptr
+	);
+	// Same as search_line(columns, first, last, ...) for a line of at least
+	// MIN_LINE_SIZE mappings
+	uint32_t search_line(
+		const uint32_t* columns,
+		uint32_t generated_line,
+		uint32_t first,
+		uint32_t last,
+		uint32_t generated_column,
+		Bias bias
+	) const;
+	size_t byte_size() const {
+		return (storage.capacity() + tree_lines.capacity()) * sizeof(uint32_t)
+			+ lines.capacity() * sizeof(LineTree);
+	}
+private:
+	// Trees have at most 7 levels above the leaves for 2^32 mappings
+	static constexpr uint32_t MAX_HEIGHT = 8;
+	struct LineTree {
+		uint32_t height;
+		// Where each level starts, top level first, in nodes from the
+		// first aligned node of storage
+		uint32_t level_start[MAX_HEIGHT];
+	};
+	// The index of the first of columns[first, last) not less than column
+	uint32_t lower_bound(
+		const LineTree& t,
+		const uint32_t* columns,
+		uint32_t first,
+		uint32_t last,
+		uint32_t column
+	) const;
+	const uint32_t* nodes() const {
+		return storage.data() + first_key;
+	}
+
+	explicit GeneratedSearchTree(Arena* arena)
+		: tree_lines(arena)
+		, lines(arena)
+		, storage(arena)
+	{}
+
+	// The lines that have a tree, in order, and their trees
+	ArenaVector<uint32_t> tree_lines;
+	ArenaVector<LineTree> lines;
+	// The nodes start at the first cache line boundary in storage
+	ArenaVector<uint32_t> storage;
+	uint32_t first_key{0};
+};
+
+// Cumulative time a map has spent in each phase since it was created. A
+// phase run on several threads adds up the time of each.
+struct MappingsTimes {
+	// Parsing, less the time in sort_ns
+	uint64_t decode_ns{0};
+	// Sorting the lines whose mappings were out of order
+	uint64_t sort_ns{0};
+	// Building the original index and the search trees
+	uint64_t index_ns{0};
+	// Batched lookups always, single ones only while lookups are timed
+	uint64_t lookup_ns{0};
+	// Lookups answered, single and batched, timed or not
+	uint64_t lookups{0};
+};
+
+// What a map holds and what it costs. The byte counts are of the memory
+// reserved for each part, which is what the map takes out of its arena.
+struct MappingsStats {
+	uint32_t mappings{0};
+	uint32_t lines{0};
+	uint32_t sources{0};
+	size_t columns_bytes{0};
+	size_t line_index_bytes{0};
+	size_t original_index_bytes{0};
+	size_t search_tree_bytes{0};
+	size_t arena_bytes{0};
+	size_t arena_used_bytes{0};
+	// The original index and the search trees have an arena of their own
+	size_t index_arena_bytes{0};
+	bool computed_column_spans{false};
+	bool has_original_index{false};
+	bool has_search_tree{false};
+	MappingsTimes times;
+};
+
 class RawMappings {
 public:
-	using LazyMappings = std::vector<
-		LazilySorted<RawMapping, cmp::Comparator>
-	>;
+	static constexpr uint32_t npos = UINT32_MAX;
+	// Everything is allocated from an arena sized for a mappings string of
+	// input_length bytes
+	explicit RawMappings(uint32_t input_length = 0);
+	~RawMappings();
 #ifdef DEBUG
 	void dump(indent ind = indent(0)) const {
 		std::cout<<ind<<"Mappings ["<<std::endl;
-		for(const auto& m: by_generated) {
+		for(uint32_t i = 0; i < by_generated.size(); i++) {
 			std::cout << ind;
-			m.dump(ind.inc());
+			at(i).dump(ind.inc());
 		}
 		std::cout<<ind<<"]"<<std::endl;
 	}
 #endif
+	// Spans are derived from the next mapping whenever they are needed,
+	// so this only makes the lookups and the JS API report them
 	void compute_column_spans() {
-		if (computed_column_spans)
-			return;
-		auto it = by_generated.begin();
-		while (it != by_generated.end()) {
-			RawMapping& m = *it++;
-			if (it != by_generated.end() && it->generated_line == m.generated_line) {
-				m.last_generated_column = it->generated_column - 1;
-			}
-		}
 		computed_column_spans = true;
 	}
-	const RawMapping* original_location_for (
+	// The mapping at index i of by_generated, with its span once spans have
+	// been computed
+	RawMapping at(uint32_t i) const;
+	// The mappings text that create() turns back into these mappings
+	std::string encode() const {
+		return encode_mappings(by_generated, line_offsets.size() - 1);
+	}
+	// The lookups return the index of the mapping in by_generated, or npos
+	uint32_t original_location_for (
 		uint32_t generated_line,
 		uint32_t generated_column,
 		Bias bias
 	);
-	const RawMapping* generated_location_for (
+	uint32_t generated_location_for (
 		uint32_t source,
 		uint32_t original_line,
 		uint32_t original_column,
 		Bias bias
 	);
-	static std::pair<RawMappings*, Error> create(const std::string& input);
-	LazyMappings& source_buckets() {
-		if (by_original) {
-			return *by_original;
-		}
-		source_buckets_slow();
-		return *by_original;
+	// Batched versions of the lookups above. When the queries are sorted by
+	// location they are answered in a single pass over by_generated (or over
+	// each source bucket) that only ever moves forward.
+	void original_locations_for(LookupBatch& batch, Bias bias);
+	void generated_locations_for(LookupBatch& batch, Bias bias);
+	// Same as original_location_for, for queries that come near each other
+	// rather than sorted up front. A query on the line of the previous one
+	// through the cursor, or on the next line, gallops from where that one
+	// ended, so walking a line in order costs O(1) amortized per query.
+	// Queries anywhere else take the usual search.
+	uint32_t original_location_for(
+		LookupCursor& cursor,
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	);
+	// Chains two maps: inner_source is the source of outer that inner was
+	// generated into, so the original locations in it are looked up in
+	// inner. The result maps outer's generated file to inner's sources and
+	// names. Mappings of outer into other sources, or whose location inner
+	// does not map, are kept without an original location, so they still
+	// end the span of the previous one.
+	static RawMappings* compose(const RawMappings& outer, uint32_t inner_source, RawMappings& inner);
+	static std::pair<RawMappings*, Error> create(const char* input, uint32_t length);
+	static std::pair<RawMappings*, Error> create(const std::string& input) {
+		return create(input.data(), input.size());
+	}
+#ifndef __CHEERP__
+	// Parses on several threads, splitting the input between generated
+	// lines; 0 threads means one per core. The result is identical to
+	// create(), errors included.
+	static std::pair<RawMappings*, Error> create_parallel(const char* input, uint32_t length, uint32_t threads = 0);
+#endif
+	// Built on first use
+	const OriginalIndex& original_index();
+	// Builds the search trees original_location_for uses from then on, which
+	// take about 1/16 of the generated_column column
+	const GeneratedSearchTree& build_search_tree();
+	bool has_search_tree() const {
+		return search_tree.has_value();
+	}
+	const Arena& memory() const {
+		return *arena;
+	}
+	// Moves the columns and the line index to an arena of their exact size
+	// if theirs is more than twice that, e.g. because they outgrew what was
+	// reserved for them and left their old copies behind
+	void shrink_to_fit();
+	// Throws away the original index and the search trees. The index is
+	// rebuilt by the next lookup that needs it, and original_location_for
+	// searches without trees until build_search_tree() is called again.
+	void drop_indexes();
+	// What the map holds on to in its arenas, indexes included
+	size_t byte_size() const {
+		return arena->capacity() + index_bytes();
 	}
-	std::vector<RawMapping> by_generated;
+	size_t index_bytes() const {
+		return index_arena ? index_arena->capacity() : 0;
+	}
+	MappingsStats stats() const;
+	// Reading the clock costs about as much as a single lookup, so those are
+	// only timed when asked for
+	void time_lookups(bool enable) {
+		timing_lookups = enable;
+	}
+private:
+	// Declared before everything allocated in it, so that it is destroyed
+	// after them
+	std::unique_ptr<Arena> arena;
+public:
+	MappingColumns by_generated;
+	// The mappings on generated line l are by_generated[line_offsets[l-1]]
+	// up to by_generated[line_offsets[l]], so there is one more entry than
+	// there are lines.
+	ArenaVector<uint32_t> line_offsets;
 	bool computed_column_spans{false};
 private:
-	LazyMappings& source_buckets_slow();
+	friend class MappingsParser;
+
+	// One more than the largest source of a mapping, counted by whatever
+	// adds the mappings
+	uint32_t source_count{0};
+
+	const OriginalIndex& original_index_slow();
+	Arena* indexes_arena();
+	uint32_t find_original_location(uint32_t generated_line, uint32_t generated_column, Bias bias) const;
+	uint32_t find_original_location(
+		LookupCursor& cursor,
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	) const;
+	uint32_t find_generated_location(
+		const OriginalIndex& index,
+		uint32_t source,
+		uint32_t original_line,
+		uint32_t original_column,
+		Bias bias
+	) const;
+
+	// Declared before the indexes, so that they are destroyed first
+	std::unique_ptr<Arena> index_arena;
+	std::optional<OriginalIndex> original_order;
+	std::optional<GeneratedSearchTree> search_tree;
+	MappingsTimes times;
+	bool timing_lookups{false};
+};
+
+// The running values of the relative fields while decoding
+struct VlqState {
+	uint32_t generated_line{1};
+	uint32_t generated_column{0};
+	uint32_t original_line{0};
+	uint32_t original_column{0};
+	uint32_t source{0};
+	uint32_t name{0};
+	// Decodes the segment at `it` into m, updating the state
+	Error read_mapping(const char*& it, const char* end, RawMapping& m);
+};
+
+// Parses a mappings string fed in chunks, e.g. as they come off the network.
+// Chunks can be split anywhere, even in the middle of a VLQ: the parser keeps
+// the relative state between chunks, and holds on to the trailing partial
+// segment until the chunk that completes it.
+class MappingsParser {
+public:
+	MappingsParser(uint32_t size_hint = 0);
+	~MappingsParser();
+	static MappingsParser* create();
+	// Once an error has been returned, every later call returns it again
+	Error feed(const char* chunk, uint32_t length);
+	// Parses what is left and hands over the result. The parser can not be
+	// used afterwards.
+	std::pair<RawMappings*, Error> finish();
+private:
+	// Times decode()
+	Error parse(const char* begin, const char* end);
+	Error decode(const char* begin, const char* end);
+	// Queues the line that just ended for sorting if it came out of order
+	void end_line();
+
+	std::unique_ptr<RawMappings> mappings;
+	std::string pending;
+	LineSorter sorter;
+	VlqState state;
+	uint32_t generated_line_start_index{0};
+	// Whether the mappings since generated_line_start_index came in order,
+	// in which case the line is not sorted again
+	bool line_sorted{true};
+	Error error{Error::NoError};
+};
+
+// Mappings that are decoded one generated line at a time, when a lookup
+// first needs that line. Creating them only indexes where each line starts,
+// so the cost of a lookup is proportional to the lines actually touched.
+// Since nothing is validated up front, errors in the input are only
+// reported by the lookups that run into them.
+class LazyRawMappings {
+public:
+	// Lines between two saved decoder states. Decoding a line first has to
+	// skip through the lines since the checkpoint before it.
+	static constexpr uint32_t CHECKPOINT_INTERVAL = 64;
+
+	static std::pair<LazyRawMappings*, Error> create(std::string input);
+	uint32_t line_count() const {
+		return line_starts.size() - 1;
+	}
+	uint32_t decoded_line_count() const {
+		return decoded_lines;
+	}
+	// The mappings of a line, sorted by column. Decoded on first use and
+	// then cached; nullptr for lines outside the map.
+	std::pair<const MappingColumns*, Error> decoded_line(uint32_t generated_line);
+	std::pair<std::optional<RawMapping>, Error> original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	);
+private:
+	LazyRawMappings() = default;
+	// Decodes a line only to bring the state past it
+	Error skip_line(uint32_t generated_line, VlqState& state) const;
+	// The decoder state at the start of a line
+	Error state_at(uint32_t generated_line, VlqState& state);
+	// Segments are decoded up to the end of the input rather than of their
+	// line, so that a segment cut short by the ';' fails as it does in
+	// RawMappings::create()
+	const char* input_end() const {
+		return input.data() + input.size();
+	}
+
+	std::string input;
+	// Byte offsets of the start of every line, plus one past the end
+	std::vector<uint32_t> line_starts;
+	// The state at the start of line k * CHECKPOINT_INTERVAL + 1
+	std::vector<VlqState> checkpoints;
+	std::vector<std::unique_ptr<MappingColumns>> lines;
+	uint32_t decoded_lines{0};
+	SortBuffers sort_buffers;
+};
+
+// An index map: sections of mappings, each starting at an offset into the
+// generated file. The offsets are kept in a sorted table that lookups binary
+// search, and a section is only parsed when a lookup first lands in it.
+class IndexedRawMappings {
+public:
+	// What a lookup found: the section, in the order sections were added,
+	// and the index in that section's by_generated. Both npos if nothing.
+	struct Location {
+		uint32_t section{RawMappings::npos};
+		uint32_t index{RawMappings::npos};
+	};
+
+	static IndexedRawMappings* create();
+	// Offsets are 0 based, as in the index map. Sections may be added in any
+	// order, but must not overlap.
+	void add_section(uint32_t line, uint32_t column, std::string input);
+	// A section whose text the caller keeps, and hands to parse_section()
+	// before the first lookup that section_for() finds in it
+	void add_section(uint32_t line, uint32_t column);
+	uint32_t section_count() const {
+		return sections.size();
+	}
+	uint32_t parsed_section_count() const {
+		return parsed_sections;
+	}
+	bool section_parsed(uint32_t section) const {
+		const Section& s = sections[section];
+		return s.mappings || s.error != Error::NoError;
+	}
+	// Parses a section from input, unless it is parsed already. Returns the
+	// error it failed with, if any.
+	Error parse_section(uint32_t section, const std::string& input);
+	// The section a generated location falls in, or npos if it is before
+	// the first one
+	uint32_t section_for(uint32_t generated_line, uint32_t generated_column) const;
+	// The mappings of a section, relative to its offset. Parsed on first
+	// use; a section that fails to parse keeps returning its error.
+	std::pair<RawMappings*, Error> section_mappings(uint32_t section);
+	// A mapping as it is placed in the whole generated file
+	RawMapping at(const Location& location);
+	// Never looks past the end of the section the location falls in
+	std::pair<Location, Error> original_location_for(
+		uint32_t generated_line,
+		uint32_t generated_column,
+		Bias bias
+	);
+	// An entry of the sorted offset table
+	struct Offset {
+		uint32_t line;
+		uint32_t column;
+		uint32_t section;
+	};
+private:
+	IndexedRawMappings() = default;
 
-	std::optional<LazyMappings> by_original;
+	struct Section {
+		uint32_t line;
+		uint32_t column;
+		// The mappings text given to add_section(), until it is parsed
+		std::string input;
+		std::unique_ptr<RawMappings> mappings;
+		Error error{Error::NoError};
+	};
+	// Sorted by offset
+	std::vector<Offset> offsets;
+	std::vector<Section> sections;
+	uint32_t parsed_sections{0};
 };
 
 #endif
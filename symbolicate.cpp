@@ -0,0 +1,665 @@
+// Native batch symbolication: resolves generated locations to original ones
+// for many queries spread across many source maps.
+//
+// Usage: mappings-symbolicate [--threads N] [--bias glb|lub] MAP_DIR QUERIES
+//
+// QUERIES has one query per line, "MAP LINE COLUMN", where MAP is the path
+// of a source map relative to MAP_DIR, LINE is 1-based and COLUMN 0-based;
+// blank lines and lines starting with '#' are skipped. Every map is read and
+// parsed once, by one of the threads, which then answers all of its queries
+// as one sorted batch. Maps are handed out largest first, and threads that
+// run out of maps steal from the others.
+//
+// The results are printed to stdout in the order of the queries, as tab
+// separated MAP LINE COLUMN SOURCE ORIGINAL_LINE ORIGINAL_COLUMN NAME, with
+// '-' for what is missing, or MAP LINE COLUMN and an error. Original lines
+// are 1-based and columns 0-based, like the queries. Timings and
+// counters are printed to stderr as JSON; the per-phase times of the
+// threads are added up.
+
+#include "raw_mappings.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t elapsed_ns(Clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+struct Options {
+	std::string map_dir;
+	std::string queries;
+	uint32_t threads{0};
+	Bias bias{Bias::GreatestLowerBound};
+};
+
+struct Query {
+	uint32_t map;
+	uint32_t line;
+	uint32_t column;
+};
+
+// The queries of one map, and what it took to answer them
+struct MapJob {
+	std::string path;
+	std::vector<uint32_t> queries;
+	// The output lines of all the queries, see Output
+	std::string text;
+	uint64_t bytes{0};
+	uint32_t mappings{0};
+	bool ok{false};
+};
+
+// Where the output line of a query is in the text of its map's job
+struct Output {
+	uint64_t offset;
+	uint32_t length;
+};
+
+// Cumulative over all the threads
+struct Counters {
+	std::atomic<uint64_t> read_ns{0};
+	std::atomic<uint64_t> parse_ns{0};
+	std::atomic<uint64_t> lookup_ns{0};
+	std::atomic<uint64_t> format_ns{0};
+	std::atomic<uint64_t> steals{0};
+};
+
+bool read_file(const std::string& path, std::string& out) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		return false;
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	out = ss.str();
+	return true;
+}
+
+void append_utf8(std::string& out, uint32_t c) {
+	if (c < 0x80) {
+		out.push_back(c);
+	} else if (c < 0x800) {
+		out.push_back(0xc0 | c >> 6);
+		out.push_back(0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		out.push_back(0xe0 | c >> 12);
+		out.push_back(0x80 | (c >> 6 & 0x3f));
+		out.push_back(0x80 | (c & 0x3f));
+	} else {
+		out.push_back(0xf0 | c >> 18);
+		out.push_back(0x80 | (c >> 12 & 0x3f));
+		out.push_back(0x80 | (c >> 6 & 0x3f));
+		out.push_back(0x80 | (c & 0x3f));
+	}
+}
+
+bool parse_hex4(const char*& it, const char* end, uint32_t& c) {
+	if (end - it < 4)
+		return false;
+	c = 0;
+	for (int k = 0; k < 4; k++, it++) {
+		int32_t d = *it >= '0' && *it <= '9' ? *it - '0'
+			: *it >= 'a' && *it <= 'f' ? *it - 'a' + 10
+			: *it >= 'A' && *it <= 'F' ? *it - 'A' + 10
+			: -1;
+		if (d < 0)
+			return false;
+		c = c << 4 | d;
+	}
+	return true;
+}
+
+// Parses the JSON string starting at the '"' at it, and leaves it past the
+// closing one
+bool parse_string(const char*& it, const char* end, std::string& out) {
+	if (it == end || *it != '"')
+		return false;
+	it++;
+	out.clear();
+	while (true) {
+		const char* run = it;
+		while (it != end && *it != '"' && *it != '\\')
+			it++;
+		out.append(run, it);
+		if (it == end || *it == '"')
+			break;
+		if (++it == end)
+			return false;
+		char e = *it++;
+		switch (e) {
+		case '"': case '\\': case '/': out.push_back(e); break;
+		case 'b': out.push_back('\b'); break;
+		case 'f': out.push_back('\f'); break;
+		case 'n': out.push_back('\n'); break;
+		case 'r': out.push_back('\r'); break;
+		case 't': out.push_back('\t'); break;
+		case 'u': {
+			uint32_t c;
+			if (!parse_hex4(it, end, c))
+				return false;
+			// A surrogate pair encodes one code point
+			uint32_t low;
+			if (c >= 0xd800 && c < 0xdc00 && end - it >= 6 && it[0] == '\\' && it[1] == 'u') {
+				const char* next = it + 2;
+				if (parse_hex4(next, end, low) && low >= 0xdc00 && low < 0xe000) {
+					c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+					it = next;
+				}
+			}
+			append_utf8(out, c);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	if (it == end)
+		return false;
+	it++;
+	return true;
+}
+
+void skip_space(const char*& it, const char* end) {
+	while (it != end && (*it == ' ' || *it == '\t' || *it == '\n' || *it == '\r'))
+		it++;
+}
+
+// Skips the JSON value at it, of any type, without checking more of it than
+// where it ends
+bool skip_value(const char*& it, const char* end) {
+	uint32_t depth = 0;
+	do {
+		if (it == end)
+			return false;
+		switch (*it) {
+		case '"':
+			for (it++; it != end && *it != '"'; it++) {
+				if (*it == '\\' && ++it == end)
+					return false;
+			}
+			if (it == end)
+				return false;
+			it++;
+			break;
+		case '[': case '{':
+			depth++;
+			it++;
+			break;
+		case ']': case '}':
+			if (!depth)
+				return false;
+			depth--;
+			it++;
+			break;
+		case ',': case ':': case ' ': case '\t': case '\n': case '\r':
+			if (!depth)
+				return false;
+			it++;
+			break;
+		default:
+			// A number, true, false or null
+			do
+				it++;
+			while (it != end && !std::strchr(",:]}[{\" \t\n\r", *it));
+			break;
+		}
+	} while (depth);
+	return true;
+}
+
+// The value of a top level field of a source map, which is all this tool
+// reads of it: just enough JSON to walk the keys of the top level object,
+// skipping the values of the others, and to parse a string or an array of
+// strings and nulls. Nulls become empty strings.
+const char* find_field(const std::string& json, const char* key) {
+	const char* it = json.data();
+	const char* end = json.data() + json.size();
+	skip_space(it, end);
+	if (it == end || *it != '{')
+		return nullptr;
+	it++;
+	std::string name;
+	while (true) {
+		skip_space(it, end);
+		if (!parse_string(it, end, name))
+			return nullptr;
+		skip_space(it, end);
+		if (it == end || *it != ':')
+			return nullptr;
+		it++;
+		skip_space(it, end);
+		if (name == key)
+			return it;
+		if (!skip_value(it, end))
+			return nullptr;
+		skip_space(it, end);
+		if (it == end || *it != ',')
+			return nullptr;
+		it++;
+	}
+}
+
+bool parse_string_array(const std::string& json, const char* key, std::vector<std::string>& out) {
+	const char* it = find_field(json, key);
+	const char* end = json.data() + json.size();
+	out.clear();
+	if (!it)
+		return true;
+	if (it == end || *it != '[')
+		return false;
+	it++;
+	skip_space(it, end);
+	if (it != end && *it == ']')
+		return true;
+	while (true) {
+		out.emplace_back();
+		if (end - it >= 4 && std::memcmp(it, "null", 4) == 0)
+			it += 4;
+		else if (!parse_string(it, end, out.back()))
+			return false;
+		skip_space(it, end);
+		if (it == end)
+			return false;
+		if (*it == ']')
+			return true;
+		if (*it != ',')
+			return false;
+		it++;
+		skip_space(it, end);
+	}
+}
+
+// A parsed map, and the names its results are printed with
+struct SourceMap {
+	std::unique_ptr<RawMappings> mappings;
+	std::vector<std::string> sources;
+	std::vector<std::string> names;
+};
+
+// Empty if it went fine, otherwise what went wrong
+std::string load_map(const std::string& path, SourceMap& map, MapJob& job, Counters& counters) {
+	auto start = Clock::now();
+	std::string json;
+	bool read = read_file(path, json);
+	counters.read_ns += elapsed_ns(start);
+	if (!read)
+		return "cannot read the map";
+	job.bytes = json.size();
+
+	start = Clock::now();
+	if (find_field(json, "sections"))
+		return "index maps are not supported";
+	const char* it = find_field(json, "mappings");
+	std::string mappings;
+	if (!it || !parse_string(it, json.data() + json.size(), mappings))
+		return "no \"mappings\" field";
+	if (!parse_string_array(json, "sources", map.sources)
+			|| !parse_string_array(json, "names", map.names))
+		return "invalid \"sources\" or \"names\"";
+	json = std::string();
+	std::pair<RawMappings*, Error> res = RawMappings::create(mappings);
+	counters.parse_ns += elapsed_ns(start);
+	if (res.second != Error::NoError)
+		return "parse error " + std::to_string(res.second);
+	map.mappings.reset(res.first);
+	job.mappings = res.first->by_generated.size();
+	return std::string();
+}
+
+void append_number(std::string& out, uint32_t n) {
+	char digits[10];
+	char* end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+	out.append(digits, end);
+}
+
+void append_query(std::string& out, const MapJob& job, const Query& q) {
+	out += job.path;
+	out.push_back('\t');
+	append_number(out, q.line);
+	out.push_back('\t');
+	append_number(out, q.column);
+	out.push_back('\t');
+}
+
+// Reads and parses a map, answers its queries and formats their results
+// into the job's text, recording where each one is in out
+void run_job(
+	MapJob& job,
+	const std::vector<Query>& queries,
+	const Options& opts,
+	Counters& counters,
+	std::vector<Output>& out
+) {
+	std::string& text = job.text;
+	auto end_line = [&text, &out](uint32_t q, size_t begin) {
+		out[q] = Output{begin, uint32_t(text.size() - begin)};
+	};
+	SourceMap map;
+	std::string error = load_map(opts.map_dir + "/" + job.path, map, job, counters);
+	if (!error.empty()) {
+		for (uint32_t q: job.queries) {
+			size_t begin = text.size();
+			append_query(text, job, queries[q]);
+			text += "error: " + error;
+			end_line(q, begin);
+		}
+		return;
+	}
+	job.ok = true;
+
+	// Sorted, the batch is answered in one forward pass over the map
+	auto start = Clock::now();
+	std::vector<std::pair<uint64_t, uint32_t>> order(job.queries.size());
+	for (uint32_t k = 0; k < order.size(); k++) {
+		const Query& q = queries[job.queries[k]];
+		order[k] = std::make_pair(uint64_t(q.line) << 32 | q.column, job.queries[k]);
+	}
+	std::sort(order.begin(), order.end());
+	LookupBatch batch;
+	batch.resize(order.size(), false);
+	for (uint32_t k = 0; k < order.size(); k++) {
+		batch.lines[k] = order[k].first >> 32;
+		batch.columns[k] = uint32_t(order[k].first);
+	}
+	map.mappings->original_locations_for(batch, opts.bias);
+	counters.lookup_ns += elapsed_ns(start);
+
+	start = Clock::now();
+	const MappingColumns& m = map.mappings->by_generated;
+	for (uint32_t k = 0; k < order.size(); k++) {
+		uint32_t q = order[k].second;
+		size_t begin = text.size();
+		append_query(text, job, queries[q]);
+		uint32_t idx = batch.results[k];
+		if (idx == RawMappings::npos) {
+			text += "-\t-\t-\t-";
+			end_line(q, begin);
+			continue;
+		}
+		uint32_t source = m.source[idx];
+		if (source < map.sources.size())
+			text += map.sources[source];
+		else
+			append_number(text, source);
+		text.push_back('\t');
+		append_number(text, m.original_line[idx]);
+		text.push_back('\t');
+		append_number(text, m.original_column[idx]);
+		text.push_back('\t');
+		if (!m.has_name[idx])
+			text.push_back('-');
+		else if (m.name[idx] < map.names.size())
+			text += map.names[m.name[idx]];
+		else
+			append_number(text, m.name[idx]);
+		end_line(q, begin);
+	}
+	counters.format_ns += elapsed_ns(start);
+}
+
+// Parses "MAP LINE COLUMN" at the start of line
+bool parse_query(std::string_view line, std::string_view& path, uint32_t& generated_line, uint32_t& generated_column) {
+	auto is_space = [](char c) {
+		return c == ' ' || c == '\t' || c == '\r';
+	};
+	const char* it = line.data();
+	const char* end = it + line.size();
+	auto field = [&]() {
+		while (it != end && is_space(*it))
+			it++;
+		const char* begin = it;
+		while (it != end && !is_space(*it))
+			it++;
+		return std::string_view(begin, it - begin);
+	};
+	auto number = [&](uint32_t& n) {
+		std::string_view digits = field();
+		const char* last = digits.data() + digits.size();
+		return !digits.empty() && std::from_chars(digits.data(), last, n).ptr == last;
+	};
+	path = field();
+	return !path.empty() && number(generated_line) && number(generated_column);
+}
+
+// Every thread has a deque of jobs, dealt largest first, that it works
+// through from the front. Once its own is empty it steals from the back of
+// the others', where the smallest jobs are, so that the owner and the thief
+// rarely want the same job and what moves late in the run is quick to
+// finish.
+class WorkStealingPool {
+public:
+	WorkStealingPool(uint32_t threads): queues(threads) {}
+	// Deals the jobs out round robin, in the given order
+	void deal(const std::vector<uint32_t>& jobs) {
+		for (uint32_t k = 0; k < jobs.size(); k++)
+			queues[k % queues.size()].jobs.push_back(jobs[k]);
+	}
+	template<class F>
+	void run(F f, Counters& counters) {
+		std::vector<std::thread> threads;
+		auto work = [this, &f, &counters](uint32_t self) {
+			uint32_t job;
+			while (take(self, job, counters))
+				f(job);
+		};
+		for (uint32_t t = 1; t < queues.size(); t++)
+			threads.emplace_back(work, t);
+		work(0);
+		for (std::thread& t: threads)
+			t.join();
+	}
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<uint32_t> jobs;
+	};
+	bool take(uint32_t self, uint32_t& job, Counters& counters) {
+		{
+			Queue& own = queues[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.jobs.empty()) {
+				job = own.jobs.front();
+				own.jobs.pop_front();
+				return true;
+			}
+		}
+		// Jobs are never added once running, so one empty round means
+		// there is nothing left
+		for (uint32_t k = 1; k < queues.size(); k++) {
+			Queue& victim = queues[(self + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.jobs.empty()) {
+				job = victim.jobs.back();
+				victim.jobs.pop_back();
+				counters.steals++;
+				return true;
+			}
+		}
+		return false;
+	}
+	std::vector<Queue> queues;
+};
+
+[[noreturn]]
+void usage(const char* argv0) {
+	std::cerr << "usage: " << argv0 << " [--threads N] [--bias glb|lub] MAP_DIR QUERIES" << std::endl;
+	std::exit(2);
+}
+
+}
+
+int main(int argc, char** argv) {
+	Options opts;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc) {
+			opts.threads = std::max(0, std::atoi(argv[++i]));
+		} else if (arg == "--bias" && i + 1 < argc) {
+			std::string bias = argv[++i];
+			if (bias == "glb")
+				opts.bias = Bias::GreatestLowerBound;
+			else if (bias == "lub")
+				opts.bias = Bias::LeastUpperBound;
+			else
+				usage(argv[0]);
+		} else if (arg.size() > 1 && arg[0] == '-') {
+			usage(argv[0]);
+		} else {
+			args.push_back(arg);
+		}
+	}
+	if (args.size() != 2)
+		usage(argv[0]);
+	opts.map_dir = args[0];
+	opts.queries = args[1];
+	if (opts.threads == 0)
+		opts.threads = std::max(1u, std::thread::hardware_concurrency());
+
+	auto total_start = Clock::now();
+	auto start = Clock::now();
+	std::string input;
+	if (!read_file(opts.queries, input)) {
+		std::cerr << "cannot open " << opts.queries << std::endl;
+		return 1;
+	}
+	std::vector<Query> queries;
+	std::vector<MapJob> jobs;
+	// The keys point into input
+	std::unordered_map<std::string_view, uint32_t> job_of;
+	uint32_t line_number = 0;
+	for (size_t pos = 0; pos < input.size();) {
+		size_t eol = input.find('\n', pos);
+		if (eol == std::string::npos)
+			eol = input.size();
+		std::string_view line(input.data() + pos, eol - pos);
+		pos = eol + 1;
+		line_number++;
+		if (line.empty() || line == "\r" || line[0] == '#')
+			continue;
+		std::string_view path;
+		Query q;
+		if (!parse_query(line, path, q.line, q.column)) {
+			std::cerr << opts.queries << ":" << line_number << ": expected MAP LINE COLUMN" << std::endl;
+			return 1;
+		}
+		auto it = job_of.emplace(path, jobs.size()).first;
+		if (it->second == jobs.size()) {
+			jobs.emplace_back();
+			jobs.back().path = std::string(path);
+		}
+		q.map = it->second;
+		jobs[q.map].queries.push_back(queries.size());
+		queries.push_back(q);
+	}
+	uint64_t read_queries_ns = elapsed_ns(start);
+
+	// Largest first, by query count as the maps have not been read yet
+	std::vector<uint32_t> order(jobs.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&jobs](uint32_t j1, uint32_t j2) {
+		return jobs[j1].queries.size() > jobs[j2].queries.size();
+	});
+	uint32_t threads = std::max<uint32_t>(1, std::min<size_t>(opts.threads, jobs.size()));
+	Counters counters;
+	std::vector<Output> out(queries.size());
+	start = Clock::now();
+	WorkStealingPool pool(threads);
+	pool.deal(order);
+	pool.run([&](uint32_t j) {
+		run_job(jobs[j], queries, opts, counters, out);
+	}, counters);
+	uint64_t resolve_ns = elapsed_ns(start);
+
+	start = Clock::now();
+	std::string buffer;
+	for (uint32_t q = 0; q < queries.size(); q++) {
+		buffer.append(jobs[queries[q].map].text, out[q].offset, out[q].length);
+		buffer.push_back('\n');
+		if (buffer.size() >= (1 << 20)) {
+			std::fwrite(buffer.data(), 1, buffer.size(), stdout);
+			buffer.clear();
+		}
+	}
+	std::fwrite(buffer.data(), 1, buffer.size(), stdout);
+	std::fflush(stdout);
+	uint64_t write_ns = elapsed_ns(start);
+	uint64_t total_ns = elapsed_ns(total_start);
+
+	uint32_t maps_ok = 0;
+	uint64_t map_bytes = 0;
+	uint64_t mappings = 0;
+	uint64_t failed_queries = 0;
+	for (const MapJob& job: jobs) {
+		map_bytes += job.bytes;
+		mappings += job.mappings;
+		if (job.ok)
+			maps_ok++;
+		else
+			failed_queries += job.queries.size();
+	}
+	double resolve_s = resolve_ns / 1e9;
+	std::fprintf(stderr,
+		"{\n"
+		"\t\"threads\": %u,\n"
+		"\t\"queries\": %zu,\n"
+		"\t\"failed_queries\": %llu,\n"
+		"\t\"maps\": %zu,\n"
+		"\t\"failed_maps\": %zu,\n"
+		"\t\"map_bytes\": %llu,\n"
+		"\t\"mappings\": %llu,\n"
+		"\t\"steals\": %llu,\n"
+		"\t\"read_queries_ns\": %llu,\n"
+		"\t\"resolve_ns\": %llu,\n"
+		"\t\"write_ns\": %llu,\n"
+		"\t\"total_ns\": %llu,\n"
+		"\t\"thread_read_ns\": %llu,\n"
+		"\t\"thread_parse_ns\": %llu,\n"
+		"\t\"thread_lookup_ns\": %llu,\n"
+		"\t\"thread_format_ns\": %llu,\n"
+		"\t\"queries_per_s\": %.0f,\n"
+		"\t\"map_mb_per_s\": %.2f\n"
+		"}\n",
+		threads,
+		queries.size(),
+		static_cast<unsigned long long>(failed_queries),
+		jobs.size(),
+		jobs.size() - maps_ok,
+		static_cast<unsigned long long>(map_bytes),
+		static_cast<unsigned long long>(mappings),
+		static_cast<unsigned long long>(counters.steals.load()),
+		static_cast<unsigned long long>(read_queries_ns),
+		static_cast<unsigned long long>(resolve_ns),
+		static_cast<unsigned long long>(write_ns),
+		static_cast<unsigned long long>(total_ns),
+		static_cast<unsigned long long>(counters.read_ns.load()),
+		static_cast<unsigned long long>(counters.parse_ns.load()),
+		static_cast<unsigned long long>(counters.lookup_ns.load()),
+		static_cast<unsigned long long>(counters.format_ns.load()),
+		resolve_s > 0 ? queries.size() / resolve_s : 0,
+		resolve_s > 0 ? map_bytes / double(1 << 20) / resolve_s : 0
+	);
+	return 0;
+}
@@ -0,0 +1,723 @@
+// Native tests for the parts of the library that the benchmark does not
+// check the results of.
+//
+// Usage: mappings-tests
+//
+// Prints each failed check and exits with the number of them.
+
+#include "raw_mappings.h"
+#include "compressed_mappings.h"
+#include "mappings_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			std::printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+// decode_segment gives what the scalar decoder does, for segments of 1 to
+// 6 fields of VLQs up to and past VLQ_MAX_DIGITS long, valid or not, ending
+// at every distance from the end of the buffer up to beyond a SIMD block
+void test_decode_segment_matches_scalar() {
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char bad[] = "!=\xff\0 ;,";
+	std::mt19937 rng(12);
+	uint32_t mismatches = 0;
+	for (uint32_t n = 0; n < 3000; n++) {
+		std::string segment;
+		uint32_t fields = 1 + rng() % 6;
+		for (uint32_t f = 0; f < fields; f++) {
+			uint32_t length = 1 + rng() % (VLQ_MAX_DIGITS + 3);
+			for (uint32_t d = 0; d + 1 < length; d++)
+				segment += digits[32 + rng() % 32];
+			segment += digits[rng() % 32];
+		}
+		switch (rng() % 4) {
+		case 0:
+			segment[rng() % segment.size()] = bad[rng() % (sizeof(bad) - 1)];
+			break;
+		case 1:
+			// Cut short after a continuation digit
+			segment.back() = digits[32 + rng() % 32];
+			break;
+		}
+		if (rng() % 2)
+			segment += rng() % 2 ? ',' : ';';
+		for (uint32_t tail = 0; tail <= 40; tail++) {
+			std::string text = segment;
+			for (uint32_t k = 0; k < tail; k++)
+				text += k % 2 ? 'C' : ',';
+			std::unique_ptr<char[]> buffer(new char[text.size()]);
+			std::copy(text.begin(), text.end(), buffer.get());
+			const char* end = buffer.get() + text.size();
+			const char* it1 = buffer.get();
+			const char* it2 = buffer.get();
+			Segment seg1;
+			Segment seg2;
+			Error err1 = decode_segment(it1, end, seg1);
+			Error err2 = decode_segment_scalar(it2, end, seg2);
+			// Where a malformed segment leaves it does not matter
+			if (err1 != err2 || (err1 == Error::NoError && (it1 != it2
+					|| seg1.count != seg2.count
+					|| !std::equal(seg1.fields, seg1.fields + seg1.count, seg2.fields))))
+				mismatches++;
+		}
+	}
+	CHECK(mismatches == 0);
+}
+
+// The bytes the columns and the line index of m take, without spare capacity
+size_t live_bytes(const RawMappings& m) {
+	size_t n = m.by_generated.size();
+	return n * 6 * sizeof(uint32_t) + (n + 63) / 64 * 2 * sizeof(uint64_t)
+		+ m.line_offsets.size() * sizeof(uint32_t);
+}
+
+// Segments of 2 bytes outgrow the columns reserved for the input length
+void test_dense_map_size() {
+	std::string input;
+	for (uint32_t line = 0; line < 20000; line++) {
+		if (line)
+			input += ';';
+		for (uint32_t k = 0; k < 50; k++)
+			input += k ? ",C" : "C";
+	}
+	std::pair<RawMappings*, Error> res = RawMappings::create(input);
+	CHECK(res.second == Error::NoError);
+	if (!res.first)
+		return;
+	CHECK(res.first->by_generated.size() == 1000000);
+	CHECK(res.first->byte_size() <= 2 * live_bytes(*res.first) + Arena::CHUNK_GRANULE);
+	delete res.first;
+}
+
+// A chunk that the pool cannot serve frees the oldest pooled ones first, as
+// far as the limit needs, and a chunk the pool can serve frees nothing
+void test_pool_evicts_on_miss() {
+	const size_t MB = 1 << 20;
+	Arena::set_pool_limit(0);
+	Arena::set_pool_limit(3 * MB);
+	delete new Arena(MB);
+	CHECK(Arena::pooled_bytes() == MB);
+	{
+		Arena larger(5 * MB / 2);
+		CHECK(Arena::pooled_bytes() == 0);
+	}
+	CHECK(Arena::pooled_bytes() == 5 * MB / 2);
+	{
+		Arena small(Arena::CHUNK_GRANULE);
+		CHECK(Arena::pooled_bytes() == 5 * MB / 2);
+	}
+	{
+		Arena same(2 * MB);
+		CHECK(Arena::pooled_bytes() == Arena::CHUNK_GRANULE);
+	}
+	Arena::set_pool_limit(0);
+	Arena::set_pool_limit(64 * MB);
+}
+
+// Lines without mappings, with the line index as the only thing growing
+void test_empty_lines_size() {
+	std::string input(100000, ';');
+	std::pair<RawMappings*, Error> res = RawMappings::create(input);
+	CHECK(res.second == Error::NoError);
+	if (!res.first)
+		return;
+	CHECK(res.first->line_offsets.size() == input.size() + 2);
+	CHECK(res.first->byte_size() <= 2 * live_bytes(*res.first) + Arena::CHUNK_GRANULE);
+	delete res.first;
+}
+
+// Only the mappings into the source that inner was generated into are
+// looked up in inner
+void test_compose_two_sources() {
+	// Columns 0, 4 and 8 map to (0, 0) of sources 0, 1 and 0
+	std::unique_ptr<RawMappings> outer(RawMappings::create(std::string("AAAA,ICAA,IDAA")).first);
+	// Column 0 maps to (3, 4) of source 2
+	std::unique_ptr<RawMappings> inner(RawMappings::create(std::string("AEGI")).first);
+	CHECK(outer && inner);
+	if (!outer || !inner)
+		return;
+	const MappingColumns& in = inner->by_generated;
+
+	CHECK(outer->stats().sources == 2);
+	std::unique_ptr<RawMappings> through0(RawMappings::compose(*outer, 0, *inner));
+	const MappingColumns& r0 = through0->by_generated;
+	CHECK(through0->stats().sources == 3);
+	CHECK(r0.size() == 3);
+	CHECK(r0.generated_column[0] == 0 && r0.generated_column[1] == 4 && r0.generated_column[2] == 8);
+	CHECK(r0.has_original[0] && !r0.has_original[1] && r0.has_original[2]);
+	for (uint32_t i: {0, 2}) {
+		CHECK(r0.source[i] == 2);
+		CHECK(r0.original_line[i] == in.original_line[0]);
+		CHECK(r0.original_column[i] == 4);
+	}
+
+	std::unique_ptr<RawMappings> through1(RawMappings::compose(*outer, 1, *inner));
+	const MappingColumns& r1 = through1->by_generated;
+	CHECK(r1.size() == 3);
+	CHECK(!r1.has_original[0] && r1.has_original[1] && !r1.has_original[2]);
+	CHECK(r1.source[1] == 2 && r1.original_column[1] == 4);
+
+	std::unique_ptr<RawMappings> through5(RawMappings::compose(*outer, 5, *inner));
+	CHECK(through5->by_generated.size() == 3);
+	for (uint32_t i = 0; i < 3; i++)
+		CHECK(!through5->by_generated.has_original[i]);
+}
+
+// A map of lines lines of per_line mappings, all with an original location
+std::string random_mappings(uint32_t seed, uint32_t lines, uint32_t per_line) {
+	std::mt19937 rng(seed);
+	std::string out;
+	char digits[VLQ_MAX_DIGITS];
+	int64_t prev[3] = {0, 0, 0};
+	for (uint32_t line = 0; line < lines; line++) {
+		if (line)
+			out += ';';
+		for (uint32_t k = 0; k < per_line; k++) {
+			if (k)
+				out += ',';
+			out.append(digits, vlq_encode(1 + rng() % 20, digits));
+			const int64_t next[3] = {int64_t(rng() % 5), int64_t(rng() % 300), int64_t(rng() % 80)};
+			for (uint32_t f = 0; f < 3; f++) {
+				out.append(digits, vlq_encode(next[f] - prev[f], digits));
+				prev[f] = next[f];
+			}
+		}
+	}
+	return out;
+}
+
+// A map of lines of up to 60 mappings, some empty, mixing mappings without
+// an original location, with one, and with a name too
+std::string mixed_mappings(uint32_t seed, uint32_t lines) {
+	std::mt19937 rng(seed);
+	std::string out;
+	char digits[VLQ_MAX_DIGITS];
+	int64_t prev[4] = {0, 0, 0, 0};
+	for (uint32_t line = 0; line < lines; line++) {
+		if (line)
+			out += ';';
+		uint32_t per_line = rng() % 8 == 0 ? 0 : rng() % 60;
+		int64_t column = 0;
+		for (uint32_t k = 0; k < per_line; k++) {
+			if (k)
+				out += ',';
+			// Columns going back now and then leave lines to sort
+			int64_t delta = std::max(int64_t(rng() % 40) - 4, -column);
+			out.append(digits, vlq_encode(delta, digits));
+			column += delta;
+			uint32_t fields = rng() % 6 == 0 ? 1 : 4 + rng() % 2;
+			for (uint32_t f = 1; f < fields; f++) {
+				delta = std::max(int64_t(rng() % 21) - 10, -prev[f - 1]);
+				out.append(digits, vlq_encode(delta, digits));
+				prev[f - 1] += delta;
+			}
+		}
+	}
+	return out;
+}
+
+// The parallel parser splits the input in chunks on as many threads, and
+// must give what the sequential one does whatever the split
+void test_parallel_matches_sequential() {
+	// Far enough above 256KB a chunk for up to 8 of them
+	std::string input = mixed_mappings(9, 40000);
+	CHECK(input.size() > 8 * 256 * 1024);
+	std::unique_ptr<RawMappings> expected(RawMappings::create(input).first);
+	CHECK(expected);
+	if (!expected)
+		return;
+	const MappingColumns& e = expected->by_generated;
+	uint32_t sources = 0;
+	for (uint32_t i = 0; i < e.size(); i++) {
+		if (e.has_original[i])
+			sources = std::max(sources, e.source[i] + 1);
+	}
+	CHECK(expected->stats().sources == sources);
+	for (uint32_t threads: {2, 3, 5, 8}) {
+		std::pair<RawMappings*, Error> res = RawMappings::create_parallel(input.data(), input.size(), threads);
+		CHECK(res.second == Error::NoError);
+		std::unique_ptr<RawMappings> m(res.first);
+		if (!m)
+			continue;
+		const MappingColumns& c = m->by_generated;
+		CHECK(c.size() == e.size());
+		if (c.size() != e.size())
+			continue;
+		uint32_t mismatches = 0;
+		for (uint32_t i = 0; i < c.size(); i++) {
+			if (c.generated_line[i] != e.generated_line[i]
+					|| c.generated_column[i] != e.generated_column[i]
+					|| c.source[i] != e.source[i]
+					|| c.original_line[i] != e.original_line[i]
+					|| c.original_column[i] != e.original_column[i]
+					|| c.name[i] != e.name[i]
+					|| c.has_original[i] != e.has_original[i]
+					|| c.has_name[i] != e.has_name[i])
+				mismatches++;
+		}
+		CHECK(mismatches == 0);
+		CHECK(m->stats().sources == expected->stats().sources);
+		CHECK(m->line_offsets.size() == expected->line_offsets.size());
+		CHECK(std::equal(m->line_offsets.begin(), m->line_offsets.end(), expected->line_offsets.begin()));
+	}
+
+	// An error in the last chunk is the one the sequential parser reports
+	input += ",A!";
+	CHECK(RawMappings::create_parallel(input.data(), input.size(), 4).second
+		== RawMappings::create(input).second);
+}
+
+bool same_mapping(const RawMapping& m1, const RawMapping& m2) {
+	auto original = [](const RawMapping& m) {
+		return m.original
+			? std::make_tuple(true, m.original->source, m.original->line, m.original->column, m.original->name)
+			: std::make_tuple(false, 0u, 0u, 0u, std::optional<uint32_t>());
+	};
+	return m1.generated_line == m2.generated_line
+		&& m1.generated_column == m2.generated_column
+		&& original(m1) == original(m2)
+		&& m1.last_generated_column == m2.last_generated_column;
+}
+
+// Compressed maps read back every mapping and find the same ones, around
+// the edges of the blocks too and among mappings of the same position
+void test_compressed_matches_raw() {
+	// A run of mappings at one column across the edge of the first block,
+	// then the mixed lines
+	std::string input;
+	char digits[VLQ_MAX_DIGITS];
+	for (uint32_t k = 0; k < 2 * CompressedRawMappings::BLOCK_SIZE; k++) {
+		if (k)
+			input += ',';
+		uint32_t at = uint32_t(k - (CompressedRawMappings::BLOCK_SIZE - 5)) < 10 ? 0 : 1;
+		input.append(digits, vlq_encode(k ? at : 0, digits));
+		input += k % 3 ? "ACA" : "";
+	}
+	input += ';' + mixed_mappings(4, 300);
+	for (bool spans: {false, true}) {
+		std::unique_ptr<RawMappings> m(RawMappings::create(input).first);
+		CHECK(m);
+		if (!m)
+			return;
+		if (spans)
+			m->compute_column_spans();
+		std::unique_ptr<CompressedRawMappings> c(CompressedRawMappings::compress(*m));
+		CHECK(c->size() == m->by_generated.size());
+		uint32_t mismatches = 0;
+		for (uint32_t i = 0; i < m->by_generated.size(); i++) {
+			if (!same_mapping(c->at(i), m->at(i)))
+				mismatches++;
+		}
+		CHECK(mismatches == 0);
+
+		mismatches = 0;
+		const MappingColumns& by = m->by_generated;
+		for (uint32_t i = 0; i < by.size(); i++) {
+			for (uint32_t line: {by.generated_line[i], by.generated_line[i] + 1}) {
+				for (uint32_t column: {by.generated_column[i] - 1, by.generated_column[i], by.generated_column[i] + 1}) {
+					for (Bias bias: {Bias::GreatestLowerBound, Bias::LeastUpperBound}) {
+						if (c->original_location_for(line, column, bias) != m->original_location_for(line, column, bias))
+							mismatches++;
+					}
+				}
+			}
+		}
+		CHECK(mismatches == 0);
+	}
+}
+
+// Lookups through a cursor find what plain ones do, whether the queries
+// walk a line, go on to the next one, jump back, or move to another map
+void test_cursor_matches_plain() {
+	// Lines long enough for the search trees, and short mixed ones
+	std::unique_ptr<RawMappings> long_lines(RawMappings::create(random_mappings(2, 20, 3000)).first);
+	long_lines->build_search_tree();
+	std::unique_ptr<RawMappings> mixed(RawMappings::create(mixed_mappings(6, 2000)).first);
+	std::mt19937 rng(8);
+	for (Bias bias: {Bias::GreatestLowerBound, Bias::LeastUpperBound}) {
+		LookupCursor cursor;
+		uint32_t mismatches = 0;
+		auto check = [&](RawMappings& m, uint32_t line, uint32_t column) {
+			if (m.original_location_for(cursor, line, column, bias) != m.original_location_for(line, column, bias))
+				mismatches++;
+		};
+		for (RawMappings* m: {long_lines.get(), mixed.get()}) {
+			const MappingColumns& c = m->by_generated;
+			uint32_t lines = m->line_offsets.size() - 1;
+			// Every column of every line in order, past the last mapping too,
+			// which also takes each line on from the one before
+			for (uint32_t line = 1; line <= lines + 1; line++) {
+				uint32_t last = line <= lines && m->line_offsets[line] > m->line_offsets[line - 1]
+					? c.generated_column[m->line_offsets[line] - 1] : 0;
+				for (uint32_t column = 0; column <= last + 2; column += 1 + rng() % 3)
+					check(*m, line, column);
+			}
+			// Back and forth
+			for (uint32_t q = 0; q < 20000; q++) {
+				uint32_t i = rng() % c.size();
+				check(*m, c.generated_line[i], c.generated_column[i] + rng() % 3 - 1);
+			}
+		}
+		// The same cursor on two maps in turn
+		for (uint32_t q = 0; q < 20000; q++) {
+			RawMappings& m = q % 2 ? *mixed : *long_lines;
+			uint32_t i = rng() % m.by_generated.size();
+			check(m, m.by_generated.generated_line[i], m.by_generated.generated_column[i] + rng() % 2);
+		}
+		CHECK(mismatches == 0);
+	}
+}
+
+// Lookups on lazily decoded maps, line after line, run into the error that
+// parsing the whole map reports
+void test_lazy_errors_match() {
+	static const char bad[] = "!g/;,A";
+	std::mt19937 rng(14);
+	uint32_t mismatches = 0;
+	for (uint32_t n = 0; n < 2000; n++) {
+		std::string input = mixed_mappings(n, 1 + rng() % 6);
+		for (uint32_t k = rng() % 3; k > 0 && !input.empty(); k--) {
+			uint32_t at = rng() % input.size();
+			if (rng() % 2)
+				input.insert(input.begin() + at, bad[rng() % (sizeof(bad) - 1)]);
+			else
+				input.erase(at, 1 + rng() % 3);
+		}
+		Error expected = RawMappings::create(input).second;
+		std::unique_ptr<LazyRawMappings> lazy(LazyRawMappings::create(input).first);
+		Error err = Error::NoError;
+		for (uint32_t line = 1; line <= lazy->line_count() && err == Error::NoError; line++)
+			err = lazy->original_location_for(line, 0, Bias::GreatestLowerBound).second;
+		if (err != expected)
+			mismatches++;
+	}
+	CHECK(mismatches == 0);
+}
+
+// The index in m of the mapping that generated_location_for should find,
+// by going through all of them
+uint32_t slow_generated_location_for(
+	const RawMappings& m,
+	uint32_t source,
+	uint32_t original_line,
+	uint32_t original_column,
+	Bias bias
+) {
+	const MappingColumns& c = m.by_generated;
+	auto key = [&c](uint32_t i) {
+		return std::make_pair(c.original_line[i], c.original_column[i]);
+	};
+	std::pair<uint32_t, uint32_t> query(original_line, original_column);
+	uint32_t found = RawMappings::npos;
+	for (uint32_t i = 0; i < c.size(); i++) {
+		if (!c.has_original[i] || c.source[i] != source)
+			continue;
+		// Ties go to the mapping first in generated order, which is last
+		// in original order for GreatestLowerBound
+		if (bias == Bias::GreatestLowerBound) {
+			if (key(i) <= query && (found == RawMappings::npos || key(found) <= key(i)))
+				found = i;
+		} else {
+			if (key(i) >= query && (found == RawMappings::npos || key(i) < key(found)))
+				found = i;
+		}
+	}
+	return found;
+}
+
+// Mappings into one source in nearly original order, each a line or so
+// after the last with the odd step back, on lines too far down for the line
+// and column to share 32 bits
+std::string nearly_sorted_mappings(uint32_t seed, uint32_t count) {
+	std::mt19937 rng(seed);
+	std::string out;
+	char digits[VLQ_MAX_DIGITS];
+	out.append(digits, vlq_encode(0, digits));
+	out.append(digits, vlq_encode(0, digits));
+	out.append(digits, vlq_encode(1 << 28, digits));
+	out.append(digits, vlq_encode(0, digits));
+	int64_t column = 0;
+	for (uint32_t k = 1; k < count; k++) {
+		out += ',';
+		out.append(digits, vlq_encode(1, digits));
+		out.append(digits, vlq_encode(0, digits));
+		out.append(digits, vlq_encode(rng() % 8 == 0 ? -1 : int64_t(rng() % 2), digits));
+		int64_t next = rng() % 5000;
+		out.append(digits, vlq_encode(next - column, digits));
+		column = next;
+	}
+	return out;
+}
+
+// Searches of the original index, single and batched, sorted or not, across
+// the sampled keys and the entries between them
+void test_generated_location_for() {
+	// Sources of a few to thousands of mappings, with many duplicate keys
+	std::unique_ptr<RawMappings> m(RawMappings::create(random_mappings(7, 100, 100)).first);
+	std::unique_ptr<RawMappings> few(RawMappings::create(std::string("AAAA,CCAC;ACEA")).first);
+	std::unique_ptr<RawMappings> wide(RawMappings::create(nearly_sorted_mappings(5, 3000)).first);
+	std::mt19937 rng(3);
+	for (RawMappings* map: {m.get(), few.get(), wide.get()}) {
+		const MappingColumns& c = map->by_generated;
+		for (Bias bias: {Bias::GreatestLowerBound, Bias::LeastUpperBound}) {
+			LookupBatch batch;
+			batch.resize(2000, true);
+			// Half anywhere, half next to the key of a mapping
+			for (uint32_t q = 0; q < batch.size(); q++) {
+				if (q % 2) {
+					uint32_t i = rng() % c.size();
+					batch.sources[q] = c.source[i];
+					batch.lines[q] = c.original_line[i] - 1 + rng() % 3;
+					batch.columns[q] = c.original_column[i] - 1 + rng() % 3;
+				} else {
+					batch.sources[q] = rng() % 7;
+					batch.lines[q] = rng() % 303;
+					batch.columns[q] = rng() % 83;
+				}
+			}
+			uint32_t mismatches = 0;
+			for (uint32_t q = 0; q < batch.size(); q++) {
+				uint32_t expected = slow_generated_location_for(
+					*map, batch.sources[q], batch.lines[q], batch.columns[q], bias);
+				if (map->generated_location_for(batch.sources[q], batch.lines[q], batch.columns[q], bias) != expected)
+					mismatches++;
+			}
+			CHECK(mismatches == 0);
+
+			for (bool sorted: {false, true}) {
+				if (sorted) {
+					std::vector<uint32_t> order(batch.size());
+					for (uint32_t q = 0; q < order.size(); q++)
+						order[q] = q;
+					std::sort(order.begin(), order.end(), [&batch](uint32_t q1, uint32_t q2) {
+						return std::tie(batch.sources[q1], batch.lines[q1], batch.columns[q1])
+							< std::tie(batch.sources[q2], batch.lines[q2], batch.columns[q2]);
+					});
+					LookupBatch unsorted = batch;
+					for (uint32_t q = 0; q < order.size(); q++) {
+						batch.sources[q] = unsorted.sources[order[q]];
+						batch.lines[q] = unsorted.lines[order[q]];
+						batch.columns[q] = unsorted.columns[order[q]];
+					}
+				}
+				map->generated_locations_for(batch, bias);
+				mismatches = 0;
+				for (uint32_t q = 0; q < batch.size(); q++) {
+					uint32_t expected = slow_generated_location_for(
+						*map, batch.sources[q], batch.lines[q], batch.columns[q], bias);
+					if (batch.results[q] != expected)
+						mismatches++;
+				}
+				CHECK(mismatches == 0);
+			}
+		}
+	}
+}
+
+// Sections whose text the caller keeps are only parsed when handed over,
+// and then look up like sections added with theirs
+void test_index_map_kept_inputs() {
+	std::unique_ptr<IndexedRawMappings> m(IndexedRawMappings::create());
+	const std::string inputs[] = {"AAAA,IAEC", "ACAA"};
+	m->add_section(0, 0);
+	m->add_section(2, 10, inputs[1]);
+	m->add_section(5, 0);
+	CHECK(m->parsed_section_count() == 0);
+
+	CHECK(m->section_for(1, 6) == 0);
+	CHECK(!m->section_parsed(0));
+	CHECK(m->parse_section(0, inputs[0]) == Error::NoError);
+	CHECK(m->parse_section(0, "!") == Error::NoError);
+	std::pair<IndexedRawMappings::Location, Error> res =
+		m->original_location_for(1, 6, Bias::GreatestLowerBound);
+	CHECK(res.second == Error::NoError);
+	CHECK(res.first.section == 0 && res.first.index == 1);
+
+	res = m->original_location_for(3, 12, Bias::GreatestLowerBound);
+	CHECK(res.second == Error::NoError);
+	CHECK(res.first.section == 1 && res.first.index == 0);
+	CHECK(m->at(res.first).generated_column == 10);
+
+	CHECK(m->section_for(6, 0) == 2);
+	CHECK(m->parse_section(2, "!") == Error::VlqInvalidBase64);
+	CHECK(m->original_location_for(6, 0, Bias::GreatestLowerBound).second == Error::VlqInvalidBase64);
+	CHECK(m->parsed_section_count() == 3);
+}
+
+// Maps of about the same size, so that a budget can be counted in maps
+struct CacheInputs {
+	std::vector<std::string> inputs;
+	size_t map_bytes;
+
+	CacheInputs() {
+		for (uint32_t i = 0; i < 5; i++)
+			inputs.push_back(random_mappings(i, 200, 300));
+		RawMappings* m = RawMappings::create(inputs[0]).first;
+		map_bytes = m->byte_size();
+		delete m;
+	}
+	RawMappings* put(RawMappingsCache& cache, uint32_t i) const {
+		return cache.put(std::to_string(i), inputs[i].data(), inputs[i].size()).first;
+	}
+};
+
+void test_cache_lru() {
+	CacheInputs in;
+	RawMappingsCache cache(in.map_bytes * 7 / 2);
+	for (uint32_t i = 0; i < 3; i++)
+		CHECK(in.put(cache, i));
+	CHECK(cache.size() == 3);
+	CHECK(cache.counters().misses == 3);
+	// 0 is used again, so 1 is the least recently used
+	CHECK(cache.get("0"));
+	CHECK(in.put(cache, 3));
+	std::vector<std::string> evicted = cache.take_evicted();
+	CHECK(evicted == std::vector<std::string>{"1"});
+	CHECK(!cache.get("1"));
+	CHECK(cache.bytes() <= cache.budget());
+	CHECK(cache.counters().hits == 1);
+	CHECK(cache.counters().misses == 5);
+	CHECK(cache.counters().evictions == 1);
+}
+
+void test_cache_lfu() {
+	CacheInputs in;
+	RawMappingsCache cache(in.map_bytes * 7 / 2, EvictionPolicy::LeastFrequentlyUsed);
+	for (uint32_t i = 0; i < 3; i++)
+		in.put(cache, i);
+	// Used 2, 3 and 3 times: 0 goes first although 1 was used less recently
+	cache.get("1");
+	cache.get("1");
+	cache.get("2");
+	cache.get("0");
+	cache.get("2");
+	in.put(cache, 3);
+	CHECK(cache.take_evicted() == std::vector<std::string>{"0"});
+}
+
+void test_cache_drops_indexes_first() {
+	CacheInputs in;
+	RawMappingsCache cache(in.map_bytes * 4);
+	for (uint32_t i = 0; i < 3; i++)
+		in.put(cache, i);
+	RawMappings* m0 = cache.get("0");
+	m0->original_index();
+	CHECK(m0->index_bytes() > 0);
+	// Counts the index, and leaves 0 as the coldest map with one
+	cache.get("1");
+	cache.trim();
+	size_t with_index = cache.bytes();
+	cache.set_budget(with_index - 1);
+	CHECK(cache.counters().index_drops == 1);
+	CHECK(cache.counters().evictions == 0);
+	CHECK(cache.size() == 3);
+	CHECK(m0->index_bytes() == 0);
+	CHECK(cache.bytes() < with_index);
+	// With no index left, maps go
+	cache.set_budget(cache.bytes() - 1);
+	CHECK(cache.counters().evictions == 1);
+	CHECK(cache.size() == 2);
+
+	// Without drop_indexes_first the map goes straight away
+	RawMappingsCache whole(in.map_bytes * 4, EvictionPolicy::LeastRecentlyUsed, false);
+	for (uint32_t i = 0; i < 3; i++)
+		in.put(whole, i);
+	whole.get("0")->original_index();
+	whole.get("1");
+	whole.trim();
+	whole.set_budget(whole.bytes() - 1);
+	CHECK(whole.counters().index_drops == 0);
+	CHECK(whole.take_evicted() == std::vector<std::string>{"2"});
+}
+
+void test_cache_keeps_last_used() {
+	CacheInputs in;
+	RawMappingsCache cache(1);
+	CHECK(in.put(cache, 0));
+	CHECK(cache.size() == 1);
+	CHECK(cache.bytes() > cache.budget());
+	CHECK(in.put(cache, 1));
+	CHECK(cache.take_evicted() == std::vector<std::string>{"0"});
+	CHECK(cache.get("1"));
+	cache.trim();
+	CHECK(cache.size() == 1);
+	CHECK(cache.remove("1"));
+	CHECK(cache.size() == 0);
+	CHECK(cache.bytes() == 0);
+}
+
+void test_cache_content_keys() {
+	CacheInputs in;
+	RawMappingsCache cache(in.map_bytes * 10);
+	std::string key0, key1, again;
+	RawMappings* m0 = cache.put_content(in.inputs[0].data(), in.inputs[0].size(), key0).first;
+	RawMappings* m1 = cache.put_content(in.inputs[1].data(), in.inputs[1].size(), key1).first;
+	CHECK(m0 && m1 && key0 != key1);
+	CHECK(cache.put_content(in.inputs[0].data(), in.inputs[0].size(), again).first == m0);
+	CHECK(again == key0);
+	CHECK(cache.counters().hits == 1);
+	CHECK(cache.counters().misses == 2);
+	// Nothing is kept of the inputs
+	CHECK(cache.bytes() == m0->byte_size() + m1->byte_size());
+
+	// Inputs a byte apart, at every place of the last block of the hash
+	std::string input = in.inputs[2].substr(0, 1000);
+	cache.put_content(input.data(), input.size(), key0);
+	for (size_t i = input.size() - 20; i < input.size(); i++) {
+		std::string changed = input;
+		changed[i] = changed[i] == 'A' ? 'B' : 'A';
+		cache.put_content(changed.data(), changed.size(), key1);
+		CHECK(key1 != key0);
+	}
+}
+
+void test_cache_errors() {
+	RawMappingsCache cache(1 << 20);
+	std::pair<RawMappings*, Error> res = cache.put("bad", "!!", 2);
+	CHECK(!res.first);
+	CHECK(res.second != Error::NoError);
+	CHECK(cache.size() == 0);
+	CHECK(!cache.get("bad"));
+}
+
+}
+
+int main() {
+	test_decode_segment_matches_scalar();
+	test_dense_map_size();
+	test_empty_lines_size();
+	test_pool_evicts_on_miss();
+	test_compose_two_sources();
+	test_parallel_matches_sequential();
+	test_compressed_matches_raw();
+	test_cursor_matches_plain();
+	test_lazy_errors_match();
+	test_generated_location_for();
+	test_index_map_kept_inputs();
+	test_cache_lru();
+	test_cache_lfu();
+	test_cache_drops_indexes_first();
+	test_cache_keeps_last_used();
+	test_cache_content_keys();
+	test_cache_errors();
+	if (failures)
+		std::printf("%d checks failed\n", failures);
+	return failures;
+}
@@ -1,5 +1,27 @@
 #include "utils.h"
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <tuple>
+#ifndef __CHEERP__
+#include <chrono>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VLQ_SIMD_WIDTH 32
+#define VLQ_SIMD_MASK 0xffffffffu
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VLQ_SIMD_WIDTH 16
+#define VLQ_SIMD_MASK 0xffffu
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define VLQ_SIMD_WIDTH 16
+#define VLQ_SIMD_MASK 0xffffu
+#endif
+
 #ifdef DEBUG
 std::ostream& operator<<(std::ostream& os, const indent& ind) {
 	for (int i = 0; i < ind.level; i++) {
@@ -9,6 +31,7 @@ std::ostream& operator<<(std::ostream& os, const indent& ind) {
 }
 #endif
 
+#ifdef __CHEERP__
 [[cheerp::genericjs]]
 [[noreturn]]
 void throw_error(Error e) {
@@ -30,6 +53,18 @@ void throw_error(Error e) {
 	case Error::VlqOverflow:
 		msg = msg->concat("the number parsed from the VLQ does not fit in a 64 bit integer");
 		break;
+	case Error::IndexIoError:
+		msg = msg->concat("could not read the index file");
+		break;
+	case Error::IndexInvalidHeader:
+		msg = msg->concat("the index is not a mappings index, or is truncated");
+		break;
+	case Error::IndexUnsupportedVersion:
+		msg = msg->concat("the index was written by an incompatible version");
+		break;
+	case Error::IndexChecksumMismatch:
+		msg = msg->concat("the index is corrupted");
+		break;
 	case Error::NoError:
 		msg = msg->concat("No error. This is a bug");
 		break;
@@ -45,8 +80,111 @@ void throw_string(const client::String& s) {
 	while(true){}
 }
 
+[[cheerp::genericjs]]
+static double performance_now_ms() {
+	double ms;
+	__asm__("performance.now()" : "=r"(ms));
+	return ms;
+}
+
+uint64_t now_ns() {
+	return performance_now_ms() * 1e6;
+}
+#else
+uint64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count();
+}
+#endif
+
+// FNV-1a over 64 bit words, in four interleaved lanes so that it runs at
+// memory speed
+uint64_t checksum64(const char* data, size_t size) {
+	const uint64_t basis = 0xcbf29ce484222325ull;
+	const uint64_t prime = 0x100000001b3ull;
+	uint64_t lanes[4] = {basis, basis + 1, basis + 2, basis + 3};
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		for (uint32_t k = 0; k < 4; k++) {
+			uint64_t w;
+			std::memcpy(&w, data + i + k * 8, sizeof(w));
+			lanes[k] = (lanes[k] ^ w) * prime;
+		}
+	}
+	for (; i < size; i++)
+		lanes[0] = (lanes[0] ^ static_cast<unsigned char>(data[i])) * prime;
+	uint64_t h = basis ^ size;
+	for (uint64_t lane: lanes)
+		h = (h ^ lane) * prime;
+	return h ^ (h >> 32);
+}
+
+namespace {
+
+uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdull;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ull;
+	k ^= k >> 33;
+	return k;
+}
+
+}
+
+Hash128 hash128(const char* data, size_t size) {
+	const uint64_t c1 = 0x87c37b91114253d5ull;
+	const uint64_t c2 = 0x4cf5ad432745937full;
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+	auto mix1 = [c1, c2](uint64_t k1) {
+		return rotl64(k1 * c1, 31) * c2;
+	};
+	auto mix2 = [c1, c2](uint64_t k2) {
+		return rotl64(k2 * c2, 33) * c1;
+	};
+	uint64_t h1 = 0;
+	uint64_t h2 = 0;
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		uint64_t k1, k2;
+		std::memcpy(&k1, bytes + i, sizeof(k1));
+		std::memcpy(&k2, bytes + i + 8, sizeof(k2));
+		h1 ^= mix1(k1);
+		h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+		h2 ^= mix2(k2);
+		h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+	}
+	// The last 1 to 15 bytes, little endian
+	size_t tail = size - i;
+	uint64_t k1 = 0;
+	uint64_t k2 = 0;
+	for (size_t j = tail; j > 8; j--)
+		k2 |= uint64_t(bytes[i + j - 1]) << ((j - 9) * 8);
+	for (size_t j = std::min<size_t>(tail, 8); j > 0; j--)
+		k1 |= uint64_t(bytes[i + j - 1]) << ((j - 1) * 8);
+	if (tail > 8)
+		h2 ^= mix2(k2);
+	if (tail > 0)
+		h1 ^= mix1(k1);
+
+	h1 ^= size;
+	h2 ^= size;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	return Hash128{h1, h2};
+}
+
 class Base64Table {
-	char table[256];
+	int8_t table[256];
 public:
 	Base64Table() {
 		memset(table, -1, 256);
@@ -62,8 +200,8 @@ public:
 			table[i] = i - '0' + ('Z' - 'A') + ('z' - 'a') + 2;
 		}
 	}
-	inline char lookup(char in) {
-		return table[in];
+	inline int8_t lookup(char in) {
+		return table[static_cast<unsigned char>(in)];
 	}
 };
 static Base64Table base64_table;
@@ -71,37 +209,276 @@ static Base64Table base64_table;
 int32_t base64_decode(char in) {
 	return base64_table.lookup(in);
 }
-std::pair<int32_t, Error> vlq_decode(std::string::const_iterator& it) {
-	int32_t r = 0;
+
+static const char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The VLQs of -511..511, which take at most two digits, precomputed
+class VlqTable {
+public:
+	static constexpr uint32_t SIZE = 1024;
+	struct Entry {
+		char digits[2];
+		uint8_t length;
+	};
+	VlqTable() {
+		for (uint32_t u = 0; u < SIZE; u++) {
+			Entry& e = entries[u];
+			e.length = 0;
+			uint32_t rest = u;
+			do {
+				uint32_t digit = rest & 31;
+				rest >>= 5;
+				if (rest)
+					digit |= 32;
+				e.digits[e.length++] = BASE64_DIGITS[digit];
+			} while (rest);
+		}
+	}
+	Entry entries[SIZE];
+};
+static VlqTable vlq_table;
+
+char* vlq_encode(int64_t value, char* out) {
+	uint64_t u = value < 0 ? (uint64_t(-value) << 1) | 1 : uint64_t(value) << 1;
+	if (u < VlqTable::SIZE) {
+		const VlqTable::Entry& e = vlq_table.entries[u];
+		memcpy(out, e.digits, 2);
+		return out + e.length;
+	}
+	do {
+		uint32_t digit = u & 31;
+		u >>= 5;
+		if (u)
+			digit |= 32;
+		*out++ = BASE64_DIGITS[digit];
+	} while (u);
+	return out;
+}
+std::pair<int64_t, Error> vlq_decode(const char*& it, const char* end) {
+	uint64_t r = 0;
 	uint32_t shift = 0;
 	bool hasContinuationBit = false;
 	do {
+		if (it == end) {
+			return std::make_pair(0, Error::VlqUnexpectedEof);
+		}
 		int32_t i = base64_decode(*it);
 		if (i<0) {
 			return std::make_pair(i, Error::VlqInvalidBase64);
 		}
+		if (shift >= VLQ_MAX_DIGITS * 5) {
+			return std::make_pair(0, Error::VlqOverflow);
+		}
 		hasContinuationBit = i & 32;
 		i &= 31;
-		r += i << shift;
+		r |= uint64_t(i) << shift;
 		shift += 5;
 		it++;
 	} while (hasContinuationBit);
 	bool shouldNegate = r & 1;
-	r >>= 1;
-	return std::make_pair(shouldNegate ? -r : r, Error::NoError) ;
+	int64_t v = r >> 1;
+	return std::make_pair(shouldNegate ? -v : v, Error::NoError) ;
 }
-Error read_relative_vlq(uint32_t& prev, std::string::const_iterator& it) {
-	int32_t decoded;
-	Error err;
-	std::tie(decoded, err) = vlq_decode(it);
-	if (err != Error::NoError)
-		return err;
-	int32_t v = decoded + prev;
-	// TODO check too big
+Error apply_relative(uint32_t& prev, int64_t delta) {
+	int64_t v = delta + prev;
 	if (v < 0)
 		return Error::UnexpectedNegativeNumber;
-	else
-		prev = v;
+	if (v > std::numeric_limits<uint32_t>::max())
+		return Error::UnexpectedlyBigNumber;
+	prev = v;
+	return Error::NoError;
+}
+
+static inline bool is_separator(char c) {
+	return c == ';' || c == ',';
+}
 
+Error decode_segment_scalar(const char*& it, const char* end, Segment& seg) {
+	seg.count = 0;
+	while (seg.count < Segment::MAX_FIELDS && it != end && !is_separator(*it)) {
+		Error err;
+		std::tie(seg.fields[seg.count], err) = vlq_decode(it, end);
+		if (err != Error::NoError)
+			return err;
+		seg.count++;
+	}
 	return Error::NoError;
 }
+
+#ifdef VLQ_SIMD_WIDTH
+// Classifies one block of VLQ_SIMD_WIDTH input bytes. On return vals holds
+// the base 64 value of every byte, and the masks have bit i set when byte i
+// is a valid base 64 digit, respectively a digit with the continuation bit.
+static inline void classify_block(const char* p, uint8_t* vals, uint32_t& valid, uint32_t& cont);
+
+#if defined(__AVX2__)
+static inline void classify_block(const char* p, uint8_t* vals, uint32_t& valid, uint32_t& cont) {
+	__m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+	auto in_range = [in](char lo, char hi) {
+		return _mm256_and_si256(
+			_mm256_cmpgt_epi8(in, _mm256_set1_epi8(lo - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), in)
+		);
+	};
+	__m256i upper = in_range('A', 'Z');
+	__m256i lower = in_range('a', 'z');
+	__m256i digit = in_range('0', '9');
+	__m256i plus = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('+'));
+	__m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+	// Each byte matches at most one class, so the offsets can be summed
+	__m256i offset = _mm256_or_si256(
+		_mm256_or_si256(
+			_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+			_mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))
+		),
+		_mm256_or_si256(
+			_mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+			_mm256_or_si256(
+				_mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')),
+				_mm256_and_si256(slash, _mm256_set1_epi8(63 - '/'))
+			)
+		)
+	);
+	__m256i ok = _mm256_or_si256(
+		_mm256_or_si256(upper, lower),
+		_mm256_or_si256(digit, _mm256_or_si256(plus, slash))
+	);
+	__m256i v = _mm256_and_si256(_mm256_add_epi8(in, offset), ok);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(vals), v);
+	valid = _mm256_movemask_epi8(ok);
+	// Move bit 5 of every value into bit 7, which is what movemask reads
+	cont = _mm256_movemask_epi8(_mm256_slli_epi16(v, 2)) & valid;
+}
+#elif defined(__SSE2__)
+static inline void classify_block(const char* p, uint8_t* vals, uint32_t& valid, uint32_t& cont) {
+	__m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	auto in_range = [in](char lo, char hi) {
+		return _mm_and_si128(
+			_mm_cmpgt_epi8(in, _mm_set1_epi8(lo - 1)),
+			_mm_cmplt_epi8(in, _mm_set1_epi8(hi + 1))
+		);
+	};
+	__m128i upper = in_range('A', 'Z');
+	__m128i lower = in_range('a', 'z');
+	__m128i digit = in_range('0', '9');
+	__m128i plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+	__m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+	// Each byte matches at most one class, so the offsets can be summed
+	__m128i offset = _mm_or_si128(
+		_mm_or_si128(
+			_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+			_mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))
+		),
+		_mm_or_si128(
+			_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+			_mm_or_si128(
+				_mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+				_mm_and_si128(slash, _mm_set1_epi8(63 - '/'))
+			)
+		)
+	);
+	__m128i ok = _mm_or_si128(
+		_mm_or_si128(upper, lower),
+		_mm_or_si128(digit, _mm_or_si128(plus, slash))
+	);
+	__m128i v = _mm_and_si128(_mm_add_epi8(in, offset), ok);
+	_mm_store_si128(reinterpret_cast<__m128i*>(vals), v);
+	valid = _mm_movemask_epi8(ok);
+	// Move bit 5 of every value into bit 7, which is what movemask reads
+	cont = _mm_movemask_epi8(_mm_slli_epi16(v, 2)) & valid;
+}
+#elif defined(__wasm_simd128__)
+static inline void classify_block(const char* p, uint8_t* vals, uint32_t& valid, uint32_t& cont) {
+	v128_t in = wasm_v128_load(p);
+	auto in_range = [in](char lo, char hi) {
+		return wasm_v128_and(
+			wasm_i8x16_gt(in, wasm_i8x16_splat(lo - 1)),
+			wasm_i8x16_lt(in, wasm_i8x16_splat(hi + 1))
+		);
+	};
+	v128_t upper = in_range('A', 'Z');
+	v128_t lower = in_range('a', 'z');
+	v128_t digit = in_range('0', '9');
+	v128_t plus = wasm_i8x16_eq(in, wasm_i8x16_splat('+'));
+	v128_t slash = wasm_i8x16_eq(in, wasm_i8x16_splat('/'));
+	// Each byte matches at most one class, so the offsets can be summed
+	v128_t offset = wasm_v128_or(
+		wasm_v128_or(
+			wasm_v128_and(upper, wasm_i8x16_splat(-'A')),
+			wasm_v128_and(lower, wasm_i8x16_splat(26 - 'a'))
+		),
+		wasm_v128_or(
+			wasm_v128_and(digit, wasm_i8x16_splat(52 - '0')),
+			wasm_v128_or(
+				wasm_v128_and(plus, wasm_i8x16_splat(62 - '+')),
+				wasm_v128_and(slash, wasm_i8x16_splat(63 - '/'))
+			)
+		)
+	);
+	v128_t ok = wasm_v128_or(
+		wasm_v128_or(upper, lower),
+		wasm_v128_or(digit, wasm_v128_or(plus, slash))
+	);
+	v128_t v = wasm_v128_and(wasm_i8x16_add(in, offset), ok);
+	wasm_v128_store(vals, v);
+	valid = wasm_i8x16_bitmask(ok);
+	cont = wasm_i8x16_bitmask(wasm_i8x16_shl(v, 2)) & valid;
+}
+#endif
+
+// Decodes a whole segment from a single classified block. Returns false when
+// the segment does not fit in the block (or is malformed in a way the scalar
+// decoder reports more precisely), in which case nothing has been consumed.
+static inline bool decode_segment_block(const char*& it, const char* end, Segment& seg, Error& err) {
+	if (end - it < VLQ_SIMD_WIDTH)
+		return false;
+	alignas(VLQ_SIMD_WIDTH) uint8_t vals[VLQ_SIMD_WIDTH];
+	uint32_t valid, cont;
+	classify_block(it, vals, valid, cont);
+
+	// Separators and invalid bytes both end the segment
+	uint32_t len = valid == VLQ_SIMD_MASK ? VLQ_SIMD_WIDTH : __builtin_ctz(~valid);
+	uint32_t term = ~cont & valid;
+	if (len < VLQ_SIMD_WIDTH)
+		term &= (1u << len) - 1;
+
+	uint32_t start = 0;
+	seg.count = 0;
+	while (term && seg.count < Segment::MAX_FIELDS) {
+		uint32_t last = __builtin_ctz(term);
+		if (last - start >= VLQ_MAX_DIGITS)
+			return false;
+		uint64_t r = 0;
+		for (uint32_t k = last + 1; k-- > start;)
+			r = (r << 5) | (vals[k] & 31);
+		int64_t v = r >> 1;
+		seg.fields[seg.count++] = r & 1 ? -v : v;
+		start = last + 1;
+		term &= term - 1;
+	}
+	if (seg.count == Segment::MAX_FIELDS) {
+		err = Error::NoError;
+	} else if (len == VLQ_SIMD_WIDTH) {
+		return false;
+	} else if (len - start > VLQ_MAX_DIGITS) {
+		return false;
+	} else if (start != len || !is_separator(it[len])) {
+		// Either a VLQ was cut short, or a field starts with a byte that
+		// is not base 64
+		err = Error::VlqInvalidBase64;
+	} else {
+		err = Error::NoError;
+	}
+	it += start;
+	return true;
+}
+#endif
+
+Error decode_segment(const char*& it, const char* end, Segment& seg) {
+#ifdef VLQ_SIMD_WIDTH
+	Error err;
+	if (decode_segment_block(it, end, seg, err))
+		return err;
+#endif
+	return decode_segment_scalar(it, end, seg);
+}
@@ -2,7 +2,10 @@
 #define _UTILS_H_
 
 #include <string>
+#include <cstdint>
+#include <utility>
 
+#ifdef __CHEERP__
 #include  <cheerp/client.h>
 #include <type_traits>
 
@@ -114,6 +117,7 @@ public:
 		return 0;
 	}
 };
+#endif
 
 #ifdef DEBUG
 #include <iostream>
@@ -137,9 +141,13 @@ enum Error {
 	VlqUnexpectedEof = 3,
 	VlqInvalidBase64 = 4,
 	VlqOverflow = 5,
+	IndexIoError = 6,
+	IndexInvalidHeader = 7,
+	IndexUnsupportedVersion = 8,
+	IndexChecksumMismatch = 9,
 };
 
-
+#ifdef __CHEERP__
 [[cheerp::genericjs]]
 [[noreturn]]
 void throw_string(const client::String& s);
@@ -147,9 +155,50 @@ void throw_string(const client::String& s);
 [[cheerp::genericjs]]
 [[noreturn]]
 void throw_error(Error e);
+#endif
+
+// The VLQ fields of one segment: the generated column, optionally followed by
+// source, original line and original column, optionally followed by name.
+// Every field is relative to the previous occurrence of the same field.
+struct Segment {
+	static constexpr uint32_t MAX_FIELDS = 5;
+	int64_t fields[MAX_FIELDS];
+	uint32_t count{0};
+};
+
+// The longest VLQ the decoder accepts: 12 digits carry 60 bits of magnitude
+// and sign, and anything longer cannot be a 32 bit value anyway, so it is
+// reported as an overflow
+static constexpr uint32_t VLQ_MAX_DIGITS = 12;
 
 int32_t base64_decode(char in);
-std::pair<int32_t, Error> vlq_decode(std::string::const_iterator& it);
-Error read_relative_vlq(uint32_t& prev, std::string::const_iterator& it);
+std::pair<int64_t, Error> vlq_decode(const char*& it, const char* end);
+// Writes the VLQ of value, |value| < 2**59, at out and returns the end of it.
+// Short VLQs are copied two bytes at a time, so out needs room for
+// VLQ_MAX_DIGITS bytes whatever the value.
+char* vlq_encode(int64_t value, char* out);
+Error apply_relative(uint32_t& prev, int64_t delta);
+// Decodes up to Segment::MAX_FIELDS VLQs starting at `it`, stopping at the
+// first ',' or ';' or at `end`. Uses SIMD when the target supports it.
+Error decode_segment(const char*& it, const char* end, Segment& seg);
+// The same a VLQ at a time, which decode_segment falls back to for segments
+// that do not fit its blocks
+Error decode_segment_scalar(const char*& it, const char* end, Segment& seg);
+
+// A monotonic clock, only meaningful as differences between two readings
+uint64_t now_ns();
+
+// A fast 64 bit hash of data, not meant to resist collisions made on purpose
+uint64_t checksum64(const char* data, size_t size);
+
+struct Hash128 {
+	uint64_t low;
+	uint64_t high;
+};
+
+// MurmurHash3 x64_128 of data with seed 0: a hash wide enough for telling
+// inputs apart by it alone, but not meant to resist collisions made on
+// purpose either
+Hash128 hash128(const char* data, size_t size);
 
 #endif